@@ -0,0 +1,93 @@
+#!/bin/sh
+# Benchmark for orderlines. Generates inputs with genlines and times the
+# modes of orderlines against tac, shuf and sort where they exist. Prints
+# one tab separated line per run to stdout:
+#
+#   tool mode dist size bytes lines seconds mb_per_s lines_per_s
+#
+# seconds is the best of BENCH_RUNS runs. Output goes to /dev/null.
+#
+# Environment:
+#   BENCH_SIZES  input sizes (default "1M 16M 128M")
+#   BENCH_DISTS  line length distributions (default "fixed uniform pareto null")
+#   BENCH_RUNS   runs per measurement (default 3)
+#   TMPDIR       where inputs are generated (default /tmp)
+
+sizes=${BENCH_SIZES:-"1M 16M 128M"}
+dists=${BENCH_DISTS:-"fixed uniform pareto null"}
+runs=${BENCH_RUNS:-3}
+tmp=${TMPDIR:-/tmp}/orderlines-bench.$$
+ol=./orderlines
+
+trap 'rm -f "$tmp"' EXIT INT TERM
+
+now() {
+    date +%s.%N
+}
+
+have() {
+    command -v "$1" >/dev/null 2>&1
+}
+
+# run tool mode command...
+run() {
+    tool=$1
+    mode=$2
+    shift 2
+    best=
+    i=0
+    while [ $i -lt $runs ] ; do
+	start=`now`
+	if ! "$@" < "$tmp" > /dev/null ; then
+	    echo "bench: $tool $mode failed" >&2
+	    return
+	fi
+	end=`now`
+	best=`echo "$start $end $best" | awk '{ t = $2 - $1; if ($3 != "" && $3 < t) t = $3; printf "%.6f", t }'`
+	i=$((i + 1))
+    done
+    echo "$tool $mode $dist $size $bytes $lines $best" | \
+	awk '{ t = $7 > 0 ? $7 : 1e-9; printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%.1f\t%.0f\n", $1, $2, $3, $4, $5, $6, $7, $5 / t / 1e6, $6 / t }'
+}
+
+printf "tool\tmode\tdist\tsize\tbytes\tlines\tseconds\tmb_per_s\tlines_per_s\n"
+
+for size in $sizes ; do
+    for dist in $dists ; do
+	if [ "$dist" = "null" ] ; then
+	    ./genlines -0 -d uniform -s "$size" > "$tmp" || exit 1
+	    z=-0
+	    zs=-z
+	else
+	    ./genlines -d "$dist" -s "$size" > "$tmp" || exit 1
+	    z=
+	    zs=
+	fi
+	bytes=`wc -c < "$tmp" | tr -d ' '`
+	if [ -z "$z" ] ; then
+	    lines=`wc -l < "$tmp" | tr -d ' '`
+	else
+	    lines=`tr -cd '\000' < "$tmp" | wc -c | tr -d ' '`
+	fi
+
+	run orderlines reverse $ol $z
+	run orderlines reverse-pipe sh -c "cat | $ol $z"
+	run orderlines randomize $ol $z -r
+	run orderlines randomize-threads $ol $z -r --threads 0
+	run orderlines sort $ol $z --sort
+	run orderlines unique $ol $z -u
+	run orderlines sample $ol $z -n 1000
+	run orderlines window $ol $z --window 10000
+	run orderlines external-randomize $ol $z -r --max-memory 4M
+	if have tac && [ -z "$z" ] ; then
+	    run tac reverse tac
+	fi
+	if have shuf ; then
+	    run shuf randomize shuf $zs
+	    run shuf sample shuf $zs -n 1000
+	fi
+	if have sort ; then
+	    run sort sort env LC_ALL=C sort -s $zs
+	fi
+    done
+done
@@ -0,0 +1,143 @@
+/* genlines generates synthetic input for benchmarking orderlines. The
+   source code is in public domain. You may do anything with the source
+   code.
+
+   Lines are made of random lower case letters. Their lengths follow one
+   of these distributions:
+
+    fixed    every line is LEN bytes
+    uniform  lengths are uniform in 0 .. 2 * LEN
+    pareto   heavy-tailed lengths with mean about LEN: most lines are
+             short and a few are very long
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+/* Longest line of the pareto distribution */
+#define GL_MAX_LINE (16 * 1024 * 1024)
+
+static uint64_t gl_state = 0x9e3779b97f4a7c15ULL;
+
+/* splitmix64 */
+static uint64_t gl_rand(void)
+{
+  uint64_t z = (gl_state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static double gl_rand01(void)
+{
+  return (gl_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t gl_line_len(const char *dist, size_t len)
+{
+  double u;
+  double x;
+  if (strcmp(dist, "fixed") == 0)
+    return len;
+  if (strcmp(dist, "uniform") == 0)
+    return gl_rand() % (2 * len + 1);
+  /* pareto with shape 1.5 has mean 3 * xmin */
+  u = 1.0 - gl_rand01();
+  x = (len / 3.0) * pow(u, -1.0 / 1.5);
+  if (x > GL_MAX_LINE)
+    x = GL_MAX_LINE;
+  return (size_t) x;
+}
+
+static int gl_parse_size(const char *str, size_t *size)
+{
+  char *end;
+  unsigned long long val = strtoull(str, &end, 10);
+  if (end == str)
+    return 0;
+  switch (*end) {
+  case 'k': case 'K': val <<= 10; end++; break;
+  case 'm': case 'M': val <<= 20; end++; break;
+  case 'g': case 'G': val <<= 30; end++; break;
+  }
+  if (*end)
+    return 0;
+  *size = val;
+  return 1;
+}
+
+static void print_help(void)
+{
+  printf("USAGE: genlines [-0] [-d DIST] [-l LEN] [-s SIZE] [--seed N]\n\n");
+  printf("Prints SIZE bytes (default 16M, K, M and G suffixes are accepted) of\n");
+  printf("random lines to stdout. DIST is fixed, uniform or pareto (default\n");
+  printf("uniform) and LEN is the (mean) line length (default 40). -0 separates\n");
+  printf("lines with \\0 instead of \\n.\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *dist = "uniform";
+  size_t len = 40;
+  size_t size = 16 * 1024 * 1024;
+  size_t written = 0;
+  size_t n;
+  size_t i;
+  char separator = '\n';
+  char *line;
+  uint64_t r = 0;
+  int ind;
+
+  for (ind = 1; ind < argc; ind++) {
+    if (strcmp(argv[ind], "-0") == 0) {
+      separator = '\0';
+    } else if (strcmp(argv[ind], "-d") == 0 && ind + 1 < argc) {
+      dist = argv[++ind];
+      if (strcmp(dist, "fixed") && strcmp(dist, "uniform") && strcmp(dist, "pareto")) {
+	fprintf(stderr, "genlines: unknown distribution %s\n", dist);
+	return 1;
+      }
+    } else if (strcmp(argv[ind], "-l") == 0 && ind + 1 < argc) {
+      len = strtoul(argv[++ind], NULL, 10);
+    } else if (strcmp(argv[ind], "-s") == 0 && ind + 1 < argc) {
+      if (!gl_parse_size(argv[++ind], &size)) {
+	fprintf(stderr, "genlines: invalid size %s\n", argv[ind]);
+	return 1;
+      }
+    } else if (strcmp(argv[ind], "--seed") == 0 && ind + 1 < argc) {
+      gl_state = strtoull(argv[++ind], NULL, 0);
+    } else {
+      print_help();
+      return strcmp(argv[ind], "-h") == 0 ? 0 : 1;
+    }
+  }
+
+  if (!(line = malloc(GL_MAX_LINE + 1))) {
+    perror("no memory for line");
+    return 1;
+  }
+  while (written < size) {
+    n = gl_line_len(dist, len);
+    if (n > GL_MAX_LINE)
+      n = GL_MAX_LINE;
+    if (n > size - written - 1)
+      n = size - written - 1;
+    for (i = 0; i < n; i++) {
+      if ((i & 7) == 0)
+	r = gl_rand();
+      line[i] = 'a' + (r & 0xff) % 26;
+      r >>= 8;
+    }
+    line[n] = separator;
+    if (fwrite(line, 1, n + 1, stdout) != n + 1) {
+      perror("write error");
+      return 1;
+    }
+    written += n + 1;
+  }
+  free(line);
+  return 0;
+}
@@ -0,0 +1,3480 @@
+/* liborderlines: the ordering engine of orderlines. The source code is
+   in public domain. You may do anything with the source code.
+
+   The orderlines program is a thin wrapper around orderlines_run(). See
+   orderlines.h for the interface and orderlines.c for the history. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <float.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "orderlines.h"
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#include <sys/random.h>
+#define RL_HAVE_GETRANDOM
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RL_X86_SIMD
+#endif
+
+/* xoshiro256** by David Blackman and Sebastiano Vigna. The generator is
+   seeded once, either from the system entropy source or from --seed. */
+struct rl_rng {
+  uint64_t s[4];
+};
+
+static struct rl_rng rl_rng;
+static int rl_seeded_from_system;
+
+static inline uint64_t rl_rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rl_rand64(struct rl_rng *rng)
+{
+  uint64_t *s = rng->s;
+  uint64_t result = rl_rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rl_rotl(s[3], 45);
+  return result;
+}
+
+/* Expands a 64-bit seed into the generator state with splitmix64 */
+static void rl_seed_rng(struct rl_rng *rng, uint64_t seed)
+{
+  int i;
+  uint64_t z;
+  for (i = 0; i < 4; i++) {
+    seed += 0x9e3779b97f4a7c15ULL;
+    z = seed;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    rng->s[i] = z ^ (z >> 31);
+  }
+}
+
+/* Returns a uniformly distributed integer in range [0, range). Uses
+   Lemire's multiply-and-reject method, so there is no modulo bias and
+   usually no division at all. */
+static inline uint64_t rl_rand_range(struct rl_rng *rng, uint64_t range)
+{
+#ifdef __SIZEOF_INT128__
+  uint64_t x = rl_rand64(rng);
+  unsigned __int128 m = ((unsigned __int128) x) * range;
+  uint64_t l = (uint64_t) m;
+  if (l < range) {
+    uint64_t t = -range % range;
+    while (l < t) {
+      x = rl_rand64(rng);
+      m = ((unsigned __int128) x) * range;
+      l = (uint64_t) m;
+    }
+  }
+  return (uint64_t) (m >> 64);
+#else
+  uint64_t t = -range % range;
+  uint64_t x;
+  do {
+    x = rl_rand64(rng);
+  } while (x < t);
+  return x % range;
+#endif
+}
+
+/* Returns a uniform random number in range (0, 1) */
+static inline double rl_rand_open01(struct rl_rng *rng)
+{
+  return ((rl_rand64(rng) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+static int rl_system_entropy(void *dst, size_t len)
+{
+  FILE *f;
+  size_t ret;
+#ifdef RL_HAVE_GETRANDOM
+  if (getrandom(dst, len, 0) == (ssize_t) len)
+    return 1;
+#endif
+  if (!(f = fopen("/dev/urandom", "r")))
+    return 0;
+  ret = fread(dst, 1, len, f);
+  fclose(f);
+  return ret == len;
+}
+
+static void rl_init_rand(void)
+{
+  uint64_t seed[4];
+  int i;
+  if (rl_system_entropy(seed, sizeof(seed))) {
+    memcpy(rl_rng.s, seed, sizeof(seed));
+    for (i = 0; i < 4; i++) {
+      if (seed[i])
+	break;
+    }
+    if (i == 4)
+      rl_seed_rng(&rl_rng, 0);
+    rl_seeded_from_system = 1;
+    return;
+  }
+  seed[0] = time(0);
+  if (seed[0] == (uint64_t) -1) {
+    fprintf(stderr, "warning. non-random sequence.\n");
+    seed[0] = 1;
+  }
+  rl_seed_rng(&rl_rng, seed[0] ^ ((uint64_t) getpid() << 32));
+}
+
+
+/* Maps the input if it is a non-empty regular file. Returns 1 if the input
+   was mapped, 0 if it must be read with the fread() loop instead, and -1 on
+   error. */
+static int rl_map_input(int fd, char **buf, size_t *used, size_t max_memory)
+{
+  struct stat st;
+  void *map;
+
+  if (fstat(fd, &st)) {
+    perror("can not stat input");
+    return -1;
+  }
+  if (!S_ISREG(st.st_mode) || st.st_size <= 0)
+    return 0;
+  if (((uintmax_t) st.st_size) > ((size_t) -1))
+    return 0;
+  /* the input does not start at the beginning of the file */
+  if (lseek(fd, 0, SEEK_CUR) != 0)
+    return 0;
+  /* with a memory limit, large files are read through the external
+     memory path instead */
+  if (max_memory && ((uintmax_t) st.st_size) > max_memory)
+    return 0;
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return 0;
+
+  /* the line index is built with one front-to-back pass */
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  *buf = map;
+  *used = st.st_size;
+  return 1;
+}
+
+
+
+static int rl_huge_pages;
+
+/* Asks for transparent huge pages for the page aligned part of a buffer.
+   Random access into a large input or index misses the TLB on almost
+   every line with 4 KiB pages. */
+static void rl_advise_huge(void *ptr, size_t len)
+{
+#ifdef MADV_HUGEPAGE
+  const uintptr_t huge = 2 * 1024 * 1024;
+  uintptr_t start = ((uintptr_t) ptr + huge - 1) & ~(huge - 1);
+  uintptr_t end = ((uintptr_t) ptr + len) & ~(huge - 1);
+  if (rl_huge_pages && end > start)
+    madvise((void *) start, end - start, MADV_HUGEPAGE);
+#else
+  (void) ptr;
+  (void) len;
+#endif
+}
+
+/* Line index entries. Offsets and lengths fit in 32 bits as long as the
+   input is under 4 GiB, which halves the index size for short lines. The
+   index is widened to 64-bit entries when the input grows beyond that. */
+struct rl_line32 {
+  uint32_t offs;
+  uint32_t len;
+};
+
+struct rl_line64 {
+  uint64_t offs;
+  uint64_t len;
+};
+
+struct rl_index {
+  int wide;                /* entries are in l64 instead of l32 */
+  struct rl_line32 *l32;
+  struct rl_line64 *l64;
+  size_t n;                /* number of lines in the index */
+  size_t max;              /* allocated number of entries */
+  size_t linestart;        /* start offset of the line being scanned */
+};
+
+static int rl_index_grow(struct rl_index *idx)
+{
+  size_t newmax = idx->max ? idx->max * 2 : 4096;
+  void *new;
+  if (idx->wide)
+    new = realloc(idx->l64, sizeof(idx->l64[0]) * newmax);
+  else
+    new = realloc(idx->l32, sizeof(idx->l32[0]) * newmax);
+  if (!new) {
+    perror("no memory for line index");
+    return 0;
+  }
+  if (idx->wide)
+    idx->l64 = new;
+  else
+    idx->l32 = new;
+  idx->max = newmax;
+  rl_advise_huge(new, newmax * (idx->wide ? sizeof(idx->l64[0]) : sizeof(idx->l32[0])));
+  return 1;
+}
+
+/* Makes sure that offsets up to 'end' can be stored in the index */
+static int rl_index_reserve(struct rl_index *idx, size_t end)
+{
+  size_t i;
+  if (idx->wide || end <= UINT32_MAX)
+    return 1;
+  if (!(idx->l64 = malloc(sizeof(idx->l64[0]) * (idx->max ? idx->max : 1)))) {
+    perror("no memory for line index");
+    return 0;
+  }
+  for (i = 0; i < idx->n; i++) {
+    idx->l64[i].offs = idx->l32[i].offs;
+    idx->l64[i].len = idx->l32[i].len;
+  }
+  free(idx->l32);
+  idx->l32 = NULL;
+  idx->wide = 1;
+  return 1;
+}
+
+/* Adds a line ending to a separator at offset 'sepoffs' */
+static inline int rl_index_add(struct rl_index *idx, size_t sepoffs)
+{
+  if (idx->n == idx->max && !rl_index_grow(idx))
+    return 0;
+  if (idx->wide) {
+    idx->l64[idx->n].offs = idx->linestart;
+    idx->l64[idx->n].len = sepoffs - idx->linestart;
+  } else {
+    idx->l32[idx->n].offs = idx->linestart;
+    idx->l32[idx->n].len = sepoffs - idx->linestart;
+  }
+  idx->n++;
+  idx->linestart = sepoffs + 1;
+  return 1;
+}
+
+/* Adds the last line if it was not terminated with a separator */
+static int rl_index_finish(struct rl_index *idx, size_t used)
+{
+  if (idx->linestart < used)
+    return rl_index_add(idx, used);
+  return 1;
+}
+
+/* Returns the number of bytes allocated for the index */
+static size_t rl_index_size(const struct rl_index *idx)
+{
+  return idx->max * (idx->wide ? sizeof(idx->l64[0]) : sizeof(idx->l32[0]));
+}
+
+static inline size_t rl_line_offs(const struct rl_index *idx, size_t i)
+{
+  return idx->wide ? idx->l64[i].offs : idx->l32[i].offs;
+}
+
+static inline size_t rl_line_len(const struct rl_index *idx, size_t i)
+{
+  return idx->wide ? idx->l64[i].len : idx->l32[i].len;
+}
+
+static inline void rl_index_swap(struct rl_index *idx, size_t a, size_t b)
+{
+  if (idx->wide) {
+    struct rl_line64 tmp = idx->l64[a];
+    idx->l64[a] = idx->l64[b];
+    idx->l64[b] = tmp;
+  } else {
+    struct rl_line32 tmp = idx->l32[a];
+    idx->l32[a] = idx->l32[b];
+    idx->l32[b] = tmp;
+  }
+}
+
+static void rl_index_free(struct rl_index *idx)
+{
+  free(idx->l32);
+  free(idx->l64);
+  memset(idx, 0, sizeof(*idx));
+}
+
+/* The scanners add the lines completed by separators in data[0 .. len - 1].
+   'base' is the index offset of data[0]. */
+static int rl_scan_scalar(struct rl_index *idx, const char *data, size_t len,
+			  size_t base, char separator)
+{
+  const char *p = data;
+  const char *end = data + len;
+  while ((p = memchr(p, separator, end - p)) != NULL) {
+    if (!rl_index_add(idx, base + (p - data)))
+      return 0;
+    p++;
+  }
+  return 1;
+}
+
+#ifdef RL_X86_SIMD
+/* Both vector scanners compare a block of bytes against the separator and
+   walk the set bits of the resulting mask, so each input byte is loaded
+   exactly once. The tail shorter than one vector is done by the scalar
+   scanner. */
+__attribute__((target("sse2")))
+static int rl_scan_sse2(struct rl_index *idx, const char *data, size_t len,
+			size_t base, char separator)
+{
+  const __m128i sep = _mm_set1_epi8(separator);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, sep));
+    while (mask) {
+      if (!rl_index_add(idx, base + i + __builtin_ctz(mask)))
+	return 0;
+      mask &= mask - 1;
+    }
+  }
+  return rl_scan_scalar(idx, data + i, len - i, base + i, separator);
+}
+
+__attribute__((target("avx2")))
+static int rl_scan_avx2(struct rl_index *idx, const char *data, size_t len,
+			size_t base, char separator)
+{
+  const __m256i sep = _mm256_set1_epi8(separator);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sep));
+    while (mask) {
+      if (!rl_index_add(idx, base + i + __builtin_ctz(mask)))
+	return 0;
+      mask &= mask - 1;
+    }
+  }
+  return rl_scan_sse2(idx, data + i, len - i, base + i, separator);
+}
+#endif
+
+static int (*rl_scan)(struct rl_index *idx, const char *data, size_t len,
+		      size_t base, char separator) = rl_scan_scalar;
+
+/* Scans 'len' new bytes whose index offset is 'base' */
+static int rl_index_scan(struct rl_index *idx, const char *data, size_t len,
+			 size_t base, char separator)
+{
+  if (!rl_index_reserve(idx, base + len))
+    return 0;
+  return rl_scan(idx, data, len, base, separator);
+}
+
+/* Multi-byte separators. Candidates are found by comparing the first
+   and the last byte of the separator at each position, 16 or 32
+   positions at a time, and then checked with memcmp(). Matches may not
+   overlap, so a candidate before idx->linestart is skipped. The scanners
+   add the lines completed by separators that lie entirely in
+   data[0 .. len - 1]. */
+static inline int rl_multi_match(struct rl_index *idx, const char *data, size_t pos,
+				 size_t base, const char *sep, size_t seplen)
+{
+  if (base + pos < idx->linestart || memcmp(data + pos, sep, seplen) != 0)
+    return 1;
+  if (!rl_index_add(idx, base + pos))
+    return 0;
+  idx->linestart = base + pos + seplen;
+  return 1;
+}
+
+static int rl_scan_multi_scalar(struct rl_index *idx, const char *data, size_t len,
+				size_t base, const char *sep, size_t seplen)
+{
+  const char *p = data;
+  const char *last;
+  if (len < seplen)
+    return 1;
+  last = data + len - seplen;   /* last possible start of a separator */
+  while (p <= last && (p = memchr(p, sep[0], last - p + 1)) != NULL) {
+    if (!rl_multi_match(idx, data, p - data, base, sep, seplen))
+      return 0;
+    p++;
+  }
+  return 1;
+}
+
+#ifdef RL_X86_SIMD
+__attribute__((target("sse2")))
+static int rl_scan_multi_sse2(struct rl_index *idx, const char *data, size_t len,
+			      size_t base, const char *sep, size_t seplen)
+{
+  const __m128i first = _mm_set1_epi8(sep[0]);
+  const __m128i lastb = _mm_set1_epi8(sep[seplen - 1]);
+  size_t i = 0;
+  for (; i + seplen - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (data + i + seplen - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+							 _mm_cmpeq_epi8(b, lastb)));
+    while (mask) {
+      if (!rl_multi_match(idx, data, i + __builtin_ctz(mask), base, sep, seplen))
+	return 0;
+      mask &= mask - 1;
+    }
+  }
+  return rl_scan_multi_scalar(idx, data + i, len - i, base + i, sep, seplen);
+}
+
+__attribute__((target("avx2")))
+static int rl_scan_multi_avx2(struct rl_index *idx, const char *data, size_t len,
+			      size_t base, const char *sep, size_t seplen)
+{
+  const __m256i first = _mm256_set1_epi8(sep[0]);
+  const __m256i lastb = _mm256_set1_epi8(sep[seplen - 1]);
+  size_t i = 0;
+  for (; i + seplen - 1 + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (data + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (data + i + seplen - 1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+							       _mm256_cmpeq_epi8(b, lastb)));
+    while (mask) {
+      if (!rl_multi_match(idx, data, i + __builtin_ctz(mask), base, sep, seplen))
+	return 0;
+      mask &= mask - 1;
+    }
+  }
+  return rl_scan_multi_sse2(idx, data + i, len - i, base + i, sep, seplen);
+}
+#endif
+
+static int (*rl_scan_multi)(struct rl_index *idx, const char *data, size_t len,
+			    size_t base, const char *sep, size_t seplen) = rl_scan_multi_scalar;
+
+/* Scans 'len' new bytes whose index offset is 'base' for a multi-byte
+   separator. A separator may have started in the bytes before data[0],
+   so up to seplen - 1 bytes of the unfinished line are scanned again. */
+static int rl_index_scan_multi(struct rl_index *idx, const char *data, size_t len,
+			       size_t base, const char *sep, size_t seplen)
+{
+  size_t back = base - idx->linestart;
+  if (back > seplen - 1)
+    back = seplen - 1;
+  if (!rl_index_reserve(idx, base + len))
+    return 0;
+  return rl_scan_multi(idx, data - back, len + back, base - back, sep, seplen);
+}
+
+static void rl_init_scan(void)
+{
+#ifdef RL_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    rl_scan = rl_scan_avx2;
+    rl_scan_multi = rl_scan_multi_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    rl_scan = rl_scan_sse2;
+    rl_scan_multi = rl_scan_multi_sse2;
+  }
+#endif
+}
+
+
+/* The input is kept in a chain of chunks instead of one buffer that is
+   grown with realloc(), so data that has been read is never copied again.
+   Index offsets are virtual: chunk slots of 2^shift bytes are laid out one
+   after another, and offset 'offs' is found in slot offs >> shift. A line
+   never crosses a chunk boundary. When a chunk fills up, the unfinished
+   line at its end is moved to the start of the next chunk. A chunk for a
+   line longer than one slot spans several slots.
+
+   Mapped input and other single buffers are wrapped as one chunk with a
+   slot size larger than any offset. */
+#define RL_CHUNK_SHIFT 24
+
+enum {
+  RL_ARENA_MALLOC,   /* chunks were allocated by the arena */
+  RL_ARENA_MAPPED,   /* a single mapped chunk */
+  RL_ARENA_BORROWED  /* a single chunk owned by the caller */
+};
+
+struct rl_chunk {
+  char *data;
+  size_t offs;       /* index offset of data[0] */
+  size_t len;        /* bytes of lines in the chunk */
+  size_t size;       /* allocated bytes */
+};
+
+struct rl_arena {
+  int type;
+  int shift;
+  struct rl_chunk *chunks;
+  size_t nchunks;
+  size_t maxchunks;
+  char **slots;
+  size_t nslots;
+  size_t maxslots;
+  size_t end;        /* index offset of the end of data */
+  size_t allocated;  /* bytes allocated for chunks */
+  unsigned long growths; /* number of chunks allocated */
+};
+
+static inline char *rl_arena_ptr(const struct rl_arena *a, size_t offs)
+{
+  return a->slots[offs >> a->shift] + (offs & ((((size_t) 1) << a->shift) - 1));
+}
+
+static void rl_arena_init(struct rl_arena *a, int shift)
+{
+  memset(a, 0, sizeof(*a));
+  a->type = RL_ARENA_MALLOC;
+  a->shift = shift;
+}
+
+/* Wraps a single buffer as an arena */
+static int rl_arena_wrap(struct rl_arena *a, char *buf, size_t len, int type)
+{
+  memset(a, 0, sizeof(*a));
+  a->type = type;
+  a->shift = sizeof(size_t) * 8 - 1;
+  a->chunks = malloc(sizeof(a->chunks[0]));
+  a->slots = malloc(sizeof(a->slots[0]));
+  if (!a->chunks || !a->slots) {
+    perror("no memory for arena");
+    free(a->chunks);
+    free(a->slots);
+    return 0;
+  }
+  a->chunks[0].data = buf;
+  a->chunks[0].offs = 0;
+  a->chunks[0].len = len;
+  a->chunks[0].size = len;
+  a->nchunks = a->maxchunks = 1;
+  a->slots[0] = buf;
+  a->nslots = a->maxslots = 1;
+  a->end = len;
+  return 1;
+}
+
+/* Appends an empty chunk and moves the unfinished line at the end of the
+   previous chunk (from idx->linestart on) into it */
+static int rl_arena_add_chunk(struct rl_arena *a, struct rl_index *idx)
+{
+  size_t slotsize = ((size_t) 1) << a->shift;
+  size_t size = slotsize;
+  size_t partial = 0;
+  size_t nslots;
+  size_t i;
+  struct rl_chunk *last = a->nchunks ? &a->chunks[a->nchunks - 1] : NULL;
+  struct rl_chunk c;
+
+  if (last)
+    partial = a->end - idx->linestart;
+  while (size < partial + slotsize / 2)
+    size *= 2;
+  nslots = size >> a->shift;
+
+  if (a->nchunks == a->maxchunks) {
+    size_t newmax = a->maxchunks ? a->maxchunks * 2 : 16;
+    struct rl_chunk *new = realloc(a->chunks, sizeof(a->chunks[0]) * newmax);
+    if (!new) {
+      perror("no memory for chunk list");
+      return 0;
+    }
+    a->chunks = new;
+    a->maxchunks = newmax;
+    last = a->nchunks ? &a->chunks[a->nchunks - 1] : NULL;
+  }
+  while (a->nslots + nslots > a->maxslots) {
+    size_t newmax = a->maxslots ? a->maxslots * 2 : 16;
+    char **new = realloc(a->slots, sizeof(a->slots[0]) * newmax);
+    if (!new) {
+      perror("no memory for chunk list");
+      return 0;
+    }
+    a->slots = new;
+    a->maxslots = newmax;
+  }
+
+  if (!(c.data = malloc(size))) {
+    perror("no memory for input chunk");
+    return 0;
+  }
+  rl_advise_huge(c.data, size);
+  c.offs = a->nslots << a->shift;
+  c.len = partial;
+  c.size = size;
+  for (i = 0; i < nslots; i++)
+    a->slots[a->nslots++] = c.data + (i << a->shift);
+  a->allocated += size;
+  a->growths++;
+
+  if (partial > 0) {
+    memcpy(c.data, rl_arena_ptr(a, idx->linestart), partial);
+    last->len -= partial;
+    if (last->len == 0) {
+      /* the previous chunk only had the unfinished line */
+      for (i = last->offs >> a->shift; i < (last->offs + last->size) >> a->shift; i++)
+	a->slots[i] = NULL;
+      free(last->data);
+      a->allocated -= last->size;
+      a->nchunks--;
+    }
+  }
+  a->chunks[a->nchunks++] = c;
+  idx->linestart = c.offs;
+  a->end = c.offs + partial;
+  return 1;
+}
+
+/* Takes the last chunk out of the arena. Its data starts at offset 0 of
+   the returned buffer, which the caller must free(). */
+static char *rl_arena_detach_last(struct rl_arena *a, size_t *len, size_t *size)
+{
+  struct rl_chunk *last;
+  size_t i;
+  if (a->nchunks == 0) {
+    *len = *size = 0;
+    return NULL;
+  }
+  last = &a->chunks[--a->nchunks];
+  for (i = last->offs >> a->shift; i < (last->offs + last->size) >> a->shift; i++)
+    a->slots[i] = NULL;
+  a->allocated -= last->size;
+  *len = last->len;
+  *size = last->size;
+  return last->data;
+}
+
+static void rl_arena_free(struct rl_arena *a)
+{
+  size_t i;
+  for (i = 0; i < a->nchunks; i++) {
+    if (a->type == RL_ARENA_MALLOC)
+      free(a->chunks[i].data);
+    else if (a->type == RL_ARENA_MAPPED)
+      munmap(a->chunks[i].data, a->chunks[i].size);
+  }
+  free(a->chunks);
+  free(a->slots);
+  memset(a, 0, sizeof(*a));
+}
+
+
+/* Returns a monotonic time in seconds for --stats */
+static double rl_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifdef IOV_MAX
+#define RL_IOV_MAX (IOV_MAX < 1024 ? IOV_MAX : 1024)
+#else
+#define RL_IOV_MAX 16
+#endif
+
+/* Lines shorter than this are copied into the staging buffer. Longer
+   lines are written directly from the input buffer. */
+#define RL_COPY_LIMIT 256
+#define RL_STAGE_SIZE (128 * 1024)
+
+/* Output is collected into an iovec batch that is flushed with one
+   writev() call. Short lines and separators are packed into a staging
+   buffer, so a batch of short lines becomes a single large segment. */
+struct rl_output {
+  int fd;
+  struct iovec iov[RL_IOV_MAX];
+  int niov;
+  char *stage;
+  size_t stageused;
+  char separator;
+  const char *sepstr;        /* the separator, &separator by default */
+  size_t seplen;
+  const char *pinned;        /* memory that never changes, see rl_output_pin */
+  size_t pinnedlen;
+  unsigned long long writes; /* number of write syscalls */
+  unsigned long long bytes;  /* number of bytes written */
+  unsigned long long spliced; /* bytes of them moved with vmsplice() */
+  unsigned long long lines;  /* number of lines queued */
+  double writetime;          /* seconds spent in write syscalls */
+};
+
+/* Segments at least this long are moved with vmsplice(). Each page of a
+   segment takes a pipe buffer slot, so short lines are cheaper to copy. */
+#define RL_SPLICE_MIN (16 * 1024)
+
+static int rl_output_init(struct rl_output *out, int fd, char separator)
+{
+  memset(out, 0, sizeof(*out));
+  out->fd = fd;
+  out->separator = separator;
+  out->sepstr = &out->separator;
+  out->seplen = 1;
+  if (posix_memalign((void **) &out->stage, 4096, RL_STAGE_SIZE)) {
+    out->stage = NULL;
+    fprintf(stderr, "no memory for output buffer\n");
+    return 0;
+  }
+  return 1;
+}
+
+/* Sets a multi-byte separator. 'sep' must stay valid while the output
+   is used. */
+static void rl_output_set_separator(struct rl_output *out, const char *sep,
+				    size_t seplen)
+{
+  out->sepstr = sep;
+  out->seplen = seplen;
+}
+
+/* Returns non-zero if the output is a pipe that vmsplice() can feed */
+static int rl_output_zerocopy(const struct rl_output *out)
+{
+#ifdef SPLICE_F_MOVE
+  struct stat st;
+  return fstat(out->fd, &st) == 0 && S_ISFIFO(st.st_mode);
+#else
+  return 0;
+#endif
+}
+
+/* Marks ptr[0 .. len - 1] as memory that stays unchanged until the
+   program exits, such as a mapped input file. If the output is a pipe,
+   long lines from there are handed to the kernel with vmsplice() instead
+   of being copied. The pipe keeps references to the pages, so the memory
+   may be unmapped after the flush. */
+static void rl_output_pin(struct rl_output *out, const char *ptr, size_t len)
+{
+  if (rl_output_zerocopy(out)) {
+    out->pinned = ptr;
+    out->pinnedlen = len;
+  }
+}
+
+static inline int rl_output_splicable(const struct rl_output *out,
+				      const struct iovec *iov)
+{
+  const char *base = iov->iov_base;
+  return out->pinned != NULL && iov->iov_len >= RL_SPLICE_MIN &&
+    base >= out->pinned && ((size_t) (base - out->pinned)) < out->pinnedlen;
+}
+
+/* Writes the queued segments. Runs of splicable segments go through
+   vmsplice() and the others through writev(), in order. */
+static int rl_output_flush(struct rl_output *out)
+{
+  struct iovec *iov = out->iov;
+  int niov = out->niov;
+  int zerocopy;
+  int cnt;
+  ssize_t ret;
+  double start = rl_now();
+
+  while (niov > 0) {
+    zerocopy = rl_output_splicable(out, iov);
+    cnt = 1;
+    while (cnt < niov && rl_output_splicable(out, iov + cnt) == zerocopy)
+      cnt++;
+#ifdef SPLICE_F_MOVE
+    if (zerocopy)
+      ret = vmsplice(out->fd, iov, cnt, 0);
+    else
+#endif
+      ret = writev(out->fd, iov, cnt);
+    out->writes++;
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if (zerocopy && (errno == EINVAL || errno == ENOSYS)) {
+	/* no vmsplice() for this output, copy from now on */
+	out->pinned = NULL;
+	out->pinnedlen = 0;
+	continue;
+      }
+      perror("write error");
+      return 0;
+    }
+    if (ret == 0) {
+      fprintf(stderr, "interesting condition writev() == 0. report this.\n");
+      return 0;
+    }
+    out->bytes += ret;
+    if (zerocopy)
+      out->spliced += ret;
+    /* skip segments that were completely written */
+    while (niov > 0 && ((size_t) ret) >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if (niov > 0) {
+      iov->iov_base = ((char *) iov->iov_base) + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  out->niov = 0;
+  out->stageused = 0;
+  out->writetime += rl_now() - start;
+  return 1;
+}
+
+static inline int rl_output_append(struct rl_output *out, const char *ptr,
+				   size_t len)
+{
+  struct iovec *last;
+  if (out->niov > 0) {
+    last = &out->iov[out->niov - 1];
+    if (((char *) last->iov_base) + last->iov_len == ptr) {
+      last->iov_len += len;
+      return 1;
+    }
+  }
+  if (out->niov == RL_IOV_MAX && !rl_output_flush(out))
+    return 0;
+  out->iov[out->niov].iov_base = (char *) ptr;
+  out->iov[out->niov].iov_len = len;
+  out->niov++;
+  return 1;
+}
+
+/* Makes room for 'len' bytes in the staging buffer and a segment for
+   them. A flush empties the staging buffer, so it must happen before the
+   bytes are copied there, not when they are appended. */
+static inline int rl_output_reserve(struct rl_output *out, size_t len)
+{
+  if (out->stageused + len > RL_STAGE_SIZE || out->niov == RL_IOV_MAX)
+    return rl_output_flush(out);
+  return 1;
+}
+
+/* Queues a line and a separator for output. If 'septail' is non-zero, the
+   bytes following the line in memory are the separator and are written
+   from there. The line data must stay valid until the next flush. */
+static int rl_output_line(struct rl_output *out, const char *line, size_t len,
+			  int septail)
+{
+  size_t seplen = out->seplen;
+  char *dst;
+  out->lines++;
+  if (len < RL_COPY_LIMIT) {
+    if (!rl_output_reserve(out, len + seplen))
+      return 0;
+    dst = out->stage + out->stageused;
+    memcpy(dst, line, len);
+    if (seplen == 1)
+      dst[len] = out->separator;
+    else
+      memcpy(dst + len, out->sepstr, seplen);
+    out->stageused += len + seplen;
+    return rl_output_append(out, dst, len + seplen);
+  }
+  if (septail)
+    return rl_output_append(out, line, len + seplen);
+  if (!rl_output_append(out, line, len))
+    return 0;
+  if (!rl_output_reserve(out, seplen))
+    return 0;
+  dst = out->stage + out->stageused;
+  memcpy(dst, out->sepstr, seplen);
+  out->stageused += seplen;
+  return rl_output_append(out, dst, seplen);
+}
+
+static void rl_output_free(struct rl_output *out)
+{
+  free(out->stage);
+  out->stage = NULL;
+}
+
+
+/* How many lines ahead the shuffle and the output prefetch */
+#define RL_PREFETCH_DIST 16
+
+/* Fisher-Yates shuffle of the index. The random swap targets are drawn
+   RL_PREFETCH_DIST steps ahead (in the same order as without prefetching)
+   so that the entries to be swapped are already being fetched into the
+   cache when they are needed. */
+static void rl_shuffle_index(struct rl_index *idx, struct rl_rng *rng)
+{
+  size_t ahead[RL_PREFETCH_DIST];
+  size_t n = idx->n;
+  size_t i, k, j;
+
+  if (n < 2)
+    return;
+  for (k = 0; k < RL_PREFETCH_DIST && k < n - 1; k++) {
+    ahead[k] = rl_rand_range(rng, n - k);
+    __builtin_prefetch(idx->wide ? (void *) &idx->l64[ahead[k]] : (void *) &idx->l32[ahead[k]], 1);
+  }
+  for (i = n - 1, k = 0; i >= 1; i--) {
+    j = ahead[k];
+    if (i > RL_PREFETCH_DIST) {
+      ahead[k] = rl_rand_range(rng, i - RL_PREFETCH_DIST + 1);
+      __builtin_prefetch(idx->wide ? (void *) &idx->l64[ahead[k]] : (void *) &idx->l32[ahead[k]], 1);
+    }
+    k = (k + 1) % RL_PREFETCH_DIST;
+    rl_index_swap(idx, j, i);
+  }
+}
+
+/* Outputs all lines of the index from the last entry to the first, or
+   from the first to the last if 'forward' is non-zero. The data of the
+   line RL_PREFETCH_DIST entries ahead is prefetched, so after a shuffle
+   the cache misses of reading lines from random places of a large input
+   overlap instead of stalling the copy into the staging buffer one by
+   one. */
+static int rl_output_index(struct rl_output *out, const struct rl_index *idx,
+			   const struct rl_arena *a, int forward)
+{
+  size_t k;
+  size_t i;
+  size_t offs;
+  size_t len;
+  for (k = 0; k < idx->n; k++) {
+    i = forward ? k : idx->n - 1 - k;
+    if (k + RL_PREFETCH_DIST < idx->n) {
+      __builtin_prefetch(rl_arena_ptr(a, rl_line_offs(idx, forward ? i + RL_PREFETCH_DIST
+							: i - RL_PREFETCH_DIST)));
+    }
+    offs = rl_line_offs(idx, i);
+    len = rl_line_len(idx, i);
+    if (!rl_output_line(out, rl_arena_ptr(a, offs), len, offs + len < a->end))
+      return 0;
+  }
+  return rl_output_flush(out);
+}
+
+
+
+/* Parallel index building and shuffling. Both split the work into one
+   part per thread, run the parts with rl_run_threads() and merge the
+   results afterwards. */
+
+/* Inputs and indexes smaller than these are handled by one thread */
+#define RL_PARALLEL_MIN_BYTES (1024 * 1024)
+#define RL_PARALLEL_MIN_LINES 65536
+
+/* Bucket size target for the parallel shuffle. A bucket of this many
+   entries fits in the cache of one core, so the local shuffles do not
+   miss the cache on every swap. */
+#define RL_BUCKET_LINES (128 * 1024)
+#define RL_MAX_BUCKETS 4096
+
+static int rl_threads = 1;
+
+/* Runs fn(arg + i * argsize) for i = 0 .. n - 1 in parallel. The calling
+   thread runs the first part, and also any part for which a thread could
+   not be created, so all parts are always run. */
+static void rl_run_threads(int n, void *(*fn)(void *), void *arg, size_t argsize)
+{
+  pthread_t th[n];
+  char created[n];
+  int i;
+  for (i = 1; i < n; i++)
+    created[i] = !pthread_create(&th[i], NULL, fn, ((char *) arg) + i * argsize);
+  fn(arg);
+  for (i = 1; i < n; i++) {
+    if (created[i])
+      pthread_join(th[i], NULL);
+    else
+      fn(((char *) arg) + i * argsize);
+  }
+}
+
+struct rl_scan_part {
+  struct rl_index idx;
+  const char *buf;
+  size_t offs;
+  size_t len;
+  char separator;
+  int ok;
+};
+
+static void *rl_scan_thread(void *arg)
+{
+  struct rl_scan_part *part = arg;
+  part->idx.linestart = part->offs;
+  part->ok = rl_scan(&part->idx, part->buf + part->offs, part->len, part->offs, part->separator);
+  return NULL;
+}
+
+/* Builds the index of buf[0 .. used - 1] with rl_threads threads. The
+   buffer is cut into parts at separators, each thread indexes one part,
+   and the part indexes are concatenated. */
+static int rl_index_scan_parallel(struct rl_index *idx, const char *buf,
+				  size_t used, char separator)
+{
+  struct rl_scan_part *parts;
+  size_t entry;
+  size_t n = 0;
+  size_t offs = 0;
+  size_t end;
+  const char *p;
+  int nparts = rl_threads;
+  int i;
+  int ok = 0;
+
+  if (nparts <= 1 || used < RL_PARALLEL_MIN_BYTES)
+    return rl_index_scan(idx, buf, used, 0, separator);
+  if (!rl_index_reserve(idx, used))
+    return 0;
+
+  if (!(parts = calloc(nparts, sizeof(parts[0])))) {
+    perror("no memory for index parts");
+    return 0;
+  }
+  for (i = 0; i < nparts; i++) {
+    end = (i == nparts - 1) ? used : used / nparts * (i + 1);
+    if (end < offs)
+      end = offs;
+    if (end < used) {
+      p = memchr(buf + end, separator, used - end);
+      end = p ? (size_t) (p - buf) + 1 : used;
+    }
+    parts[i].idx.wide = idx->wide;
+    parts[i].buf = buf;
+    parts[i].offs = offs;
+    parts[i].len = end - offs;
+    parts[i].separator = separator;
+    offs = end;
+  }
+
+  rl_run_threads(nparts, rl_scan_thread, parts, sizeof(parts[0]));
+
+  for (i = 0; i < nparts; i++) {
+    if (!parts[i].ok)
+      goto out;
+    n += parts[i].idx.n;
+  }
+  while (idx->max < idx->n + n) {
+    if (!rl_index_grow(idx))
+      goto out;
+  }
+  entry = idx->wide ? sizeof(idx->l64[0]) : sizeof(idx->l32[0]);
+  for (i = 0; i < nparts; i++) {
+    if (idx->wide)
+      memcpy(&idx->l64[idx->n], parts[i].idx.l64, entry * parts[i].idx.n);
+    else
+      memcpy(&idx->l32[idx->n], parts[i].idx.l32, entry * parts[i].idx.n);
+    idx->n += parts[i].idx.n;
+  }
+  idx->linestart = offs;
+  for (i = nparts - 1; i >= 0; i--) {
+    if (parts[i].idx.n > 0) {
+      idx->linestart = parts[i].idx.linestart;
+      break;
+    }
+  }
+  ok = 1;
+
+  out:
+  for (i = 0; i < nparts; i++)
+    rl_index_free(&parts[i].idx);
+  free(parts);
+  return ok;
+}
+
+struct rl_shuffle_job {
+  struct rl_index *idx;
+  void *dst;             /* scatter destination, same layout as the index */
+  uint16_t *bucket;      /* bucket of each line */
+  size_t *count;         /* line counts, nbuckets per thread */
+  size_t *bucketstart;   /* first entry of each bucket in dst */
+  size_t nbuckets;
+  int nthreads;
+  int phase;
+  uint64_t seed;
+  size_t nextbucket;     /* next bucket to shuffle, taken atomically */
+};
+
+struct rl_shuffle_part {
+  struct rl_shuffle_job *job;
+  int thread;
+};
+
+static void *rl_shuffle_thread(void *arg)
+{
+  struct rl_shuffle_part *part = arg;
+  struct rl_shuffle_job *job = part->job;
+  struct rl_index *idx = job->idx;
+  size_t *count = job->count + part->thread * job->nbuckets;
+  size_t first = idx->n / job->nthreads * part->thread;
+  size_t last = (part->thread == job->nthreads - 1) ? idx->n : idx->n / job->nthreads * (part->thread + 1);
+  size_t i, j, b, start, len;
+  struct rl_rng rng;
+
+  switch (job->phase) {
+  case 0:
+    /* choose a uniformly random bucket for each line of this slice */
+    rl_seed_rng(&rng, job->seed + part->thread);
+    for (i = first; i < last; i++) {
+      b = rl_rand_range(&rng, job->nbuckets);
+      job->bucket[i] = b;
+      count[b]++;
+    }
+    break;
+
+  case 1:
+    /* scatter the slice to positions computed from the counts */
+    for (i = first; i < last; i++) {
+      b = job->bucket[i];
+      if (idx->wide)
+	((struct rl_line64 *) job->dst)[count[b]++] = idx->l64[i];
+      else
+	((struct rl_line32 *) job->dst)[count[b]++] = idx->l32[i];
+    }
+    break;
+
+  case 2:
+    /* shuffle buckets locally. each bucket has its own generator so that
+       the result does not depend on which thread takes the bucket. */
+    while ((b = __sync_fetch_and_add(&job->nextbucket, 1)) < job->nbuckets) {
+      start = job->bucketstart[b];
+      len = job->bucketstart[b + 1] - start;
+      rl_seed_rng(&rng, job->seed + job->nthreads + b);
+      for (i = len; i > 1; i--) {
+	j = rl_rand_range(&rng, i);
+	if (idx->wide) {
+	  struct rl_line64 *l = ((struct rl_line64 *) job->dst) + start;
+	  struct rl_line64 tmp = l[j];
+	  l[j] = l[i - 1];
+	  l[i - 1] = tmp;
+	} else {
+	  struct rl_line32 *l = ((struct rl_line32 *) job->dst) + start;
+	  struct rl_line32 tmp = l[j];
+	  l[j] = l[i - 1];
+	  l[i - 1] = tmp;
+	}
+      }
+    }
+    break;
+  }
+  return NULL;
+}
+
+/* Shuffles the index with rl_threads threads. Every line is sent to a
+   uniformly random bucket, the buckets are laid out one after another and
+   each bucket is shuffled on its own, which gives a uniform permutation.
+   Returns 0 if the index is too small to bother, in which case the caller
+   does a sequential Fisher-Yates shuffle. Returns -1 on error. */
+static int rl_shuffle_parallel(struct rl_index *idx)
+{
+  struct rl_shuffle_job job;
+  struct rl_shuffle_part *parts = NULL;
+  size_t entry = idx->wide ? sizeof(idx->l64[0]) : sizeof(idx->l32[0]);
+  size_t pos, c, b;
+  int i;
+  int ret = -1;
+
+  if (rl_threads <= 1 || idx->n < RL_PARALLEL_MIN_LINES)
+    return 0;
+
+  memset(&job, 0, sizeof(job));
+  job.idx = idx;
+  job.nthreads = rl_threads;
+  job.nbuckets = idx->n / RL_BUCKET_LINES + 1;
+  if (job.nbuckets < (size_t) rl_threads)
+    job.nbuckets = rl_threads;
+  if (job.nbuckets > RL_MAX_BUCKETS)
+    job.nbuckets = RL_MAX_BUCKETS;
+  job.seed = rl_rand64(&rl_rng);
+
+  job.dst = malloc(entry * idx->max);
+  job.bucket = malloc(sizeof(job.bucket[0]) * idx->n);
+  job.count = calloc(job.nbuckets * rl_threads, sizeof(job.count[0]));
+  job.bucketstart = malloc(sizeof(job.bucketstart[0]) * (job.nbuckets + 1));
+  parts = malloc(sizeof(parts[0]) * rl_threads);
+  if (!job.dst || !job.bucket || !job.count || !job.bucketstart || !parts) {
+    perror("no memory for parallel shuffle");
+    goto out;
+  }
+  for (i = 0; i < rl_threads; i++) {
+    parts[i].job = &job;
+    parts[i].thread = i;
+  }
+
+  job.phase = 0;
+  rl_run_threads(rl_threads, rl_shuffle_thread, parts, sizeof(parts[0]));
+
+  /* bucket b of slice t goes after bucket b of slices 0 .. t - 1 */
+  pos = 0;
+  for (b = 0; b < job.nbuckets; b++) {
+    job.bucketstart[b] = pos;
+    for (i = 0; i < rl_threads; i++) {
+      c = job.count[i * job.nbuckets + b];
+      job.count[i * job.nbuckets + b] = pos;
+      pos += c;
+    }
+  }
+  job.bucketstart[job.nbuckets] = pos;
+
+  job.phase = 1;
+  rl_run_threads(rl_threads, rl_shuffle_thread, parts, sizeof(parts[0]));
+  job.phase = 2;
+  rl_run_threads(rl_threads, rl_shuffle_thread, parts, sizeof(parts[0]));
+
+  if (idx->wide) {
+    free(idx->l64);
+    idx->l64 = job.dst;
+  } else {
+    free(idx->l32);
+    idx->l32 = job.dst;
+  }
+  job.dst = NULL;
+  ret = 1;
+
+  out:
+  free(job.dst);
+  free(job.bucket);
+  free(job.count);
+  free(job.bucketstart);
+  free(parts);
+  return ret;
+}
+
+/* Sorting. The index is sorted through an array of records that cache an
+   8 byte prefix of each key, so most comparisons and all radix passes
+   read the records sequentially instead of the line data. The records
+   are sorted with an MSD radix sort on the prefix bytes. Groups that
+   share the whole prefix load the next 8 bytes of their keys and are
+   sorted again. Equal keys keep their input order. */
+
+enum {
+  RL_SORT_NONE,
+  RL_SORT_LEX,      /* byte order, like sort with LC_ALL=C */
+  RL_SORT_NUMERIC,  /* leading decimal number */
+  RL_SORT_PREFIX    /* prefixes filled in by the caller */
+};
+
+struct rl_sortrec {
+  uint64_t prefix;
+  size_t line;       /* position of the line in the index */
+};
+
+struct rl_sort_ctx {
+  const struct rl_index *idx;
+  const struct rl_arena *arena;
+  int mode;
+  size_t field;      /* key field number starting from 1, 0 is whole line */
+  int fieldsep;      /* field separator, or -1 for runs of blanks */
+  struct rl_sortrec *aux;
+  size_t nextbucket; /* next top level bucket, taken atomically */
+  size_t bucketstart[257];
+};
+
+/* Small groups are sorted by insertion */
+#define RL_SORT_SMALL 32
+
+/* Finds the key of a line: the whole line or the selected field */
+static void rl_sort_key(const struct rl_sort_ctx *ctx, size_t line,
+			const char **key, size_t *keylen)
+{
+  size_t offs = rl_line_offs(ctx->idx, line);
+  const char *p = rl_arena_ptr(ctx->arena, offs);
+  const char *end = p + rl_line_len(ctx->idx, line);
+  const char *start;
+  size_t field;
+
+  if (ctx->field == 0) {
+    *key = p;
+    *keylen = end - p;
+    return;
+  }
+  for (field = 1; ; field++) {
+    if (ctx->fieldsep < 0) {
+      while (p < end && (*p == ' ' || *p == '\t'))
+	p++;
+      start = p;
+      while (p < end && *p != ' ' && *p != '\t')
+	p++;
+    } else {
+      start = p;
+      p = memchr(p, ctx->fieldsep, end - p);
+      if (p == NULL)
+	p = end;
+    }
+    if (field == ctx->field || p == end) {
+      if (field != ctx->field)
+	start = end;
+      *key = start;
+      *keylen = p - start;
+      return;
+    }
+    if (ctx->fieldsep >= 0)
+      p++;
+  }
+}
+
+/* Loads big endian key bytes depth .. depth + 7 into a prefix, padding
+   with zeros */
+static inline uint64_t rl_sort_prefix(const char *key, size_t keylen, size_t depth)
+{
+  uint64_t prefix = 0;
+  size_t i;
+  for (i = 0; i < 8; i++) {
+    prefix <<= 8;
+    if (depth + i < keylen)
+      prefix |= (unsigned char) key[depth + i];
+  }
+  return prefix;
+}
+
+/* Maps the leading number of a key to an integer with the same order */
+static uint64_t rl_sort_numeric(const char *key, size_t keylen)
+{
+  const char *p = key;
+  const char *end = key + keylen;
+  double val = 0;
+  double scale = 0.1;
+  int negative = 0;
+  uint64_t bits;
+
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  if (p < end && *p == '-') {
+    negative = 1;
+    p++;
+  }
+  while (p < end && *p >= '0' && *p <= '9')
+    val = val * 10 + (*p++ - '0');
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      val += (*p++ - '0') * scale;
+      scale *= 0.1;
+    }
+  }
+  if (negative)
+    val = -val;
+  if (val == 0)
+    val = 0;     /* -0 sorts as 0 */
+  memcpy(&bits, &val, sizeof(bits));
+  return (bits >> 63) ? ~bits : (bits | (((uint64_t) 1) << 63));
+}
+
+/* Compares two records whose keys are equal before 'depth' */
+static int rl_sort_cmp(const struct rl_sort_ctx *ctx, const struct rl_sortrec *a,
+		       const struct rl_sortrec *b, size_t depth)
+{
+  const char *ka, *kb;
+  size_t la, lb, minlen;
+  int ret;
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+  if (ctx->mode == RL_SORT_LEX) {
+    rl_sort_key(ctx, a->line, &ka, &la);
+    rl_sort_key(ctx, b->line, &kb, &lb);
+    minlen = la < lb ? la : lb;
+    if (minlen > depth + 8) {
+      ret = memcmp(ka + depth + 8, kb + depth + 8, minlen - depth - 8);
+      if (ret)
+	return ret;
+    }
+    if (la != lb)
+      return la < lb ? -1 : 1;
+  }
+  return a->line < b->line ? -1 : (a->line > b->line);
+}
+
+static void rl_sort_insertion(const struct rl_sort_ctx *ctx, struct rl_sortrec *r,
+			      size_t n, size_t depth)
+{
+  size_t i, j;
+  struct rl_sortrec tmp;
+  for (i = 1; i < n; i++) {
+    tmp = r[i];
+    for (j = i; j > 0 && rl_sort_cmp(ctx, &tmp, &r[j - 1], depth) < 0; j--)
+      r[j] = r[j - 1];
+    r[j] = tmp;
+  }
+}
+
+/* Orders keys that ended by length (kept in the prefix field), then by
+   input order */
+static int rl_sort_len_cmp(const void *pa, const void *pb)
+{
+  const struct rl_sortrec *a = pa;
+  const struct rl_sortrec *b = pb;
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+  return a->line < b->line ? -1 : (a->line > b->line);
+}
+
+/* Sorts a group whose keys share bytes 0 .. depth + 7. Keys that end
+   within those bytes are moved to the front and ordered by length. The
+   other records load their next 8 bytes into the prefix. Returns the
+   number of ended keys. */
+static size_t rl_sort_deeper(const struct rl_sort_ctx *ctx, struct rl_sortrec *r,
+			     struct rl_sortrec *aux, size_t n, size_t depth)
+{
+  const char *key;
+  size_t keylen;
+  size_t ended = 0;
+  size_t rest = 0;
+  size_t i;
+
+  if (ctx->mode != RL_SORT_LEX)
+    return n;   /* other keys are the whole prefix, input order is kept */
+
+  for (i = 0; i < n; i++) {
+    rl_sort_key(ctx, r[i].line, &key, &keylen);
+    if (keylen <= depth + 8) {
+      r[ended] = r[i];
+      r[ended].prefix = keylen;
+      ended++;
+    } else {
+      aux[rest] = r[i];
+      aux[rest].prefix = rl_sort_prefix(key, keylen, depth + 8);
+      rest++;
+    }
+  }
+  memcpy(r + ended, aux, rest * sizeof(r[0]));
+  if (ended > 1)
+    qsort(r, ended, sizeof(r[0]), rl_sort_len_cmp);
+  return ended;
+}
+
+/* Counts the records of each value of prefix byte 'byte' and scatters
+   them stably into their buckets. Fills bucketstart[0 .. 256]. Returns
+   the largest bucket. */
+static int rl_radix_pass(struct rl_sortrec *r, struct rl_sortrec *aux,
+			 size_t n, int byte, size_t *bucketstart)
+{
+  size_t pos[256];
+  int shift = 56 - 8 * byte;
+  int largest = 0;
+  size_t i;
+  int b;
+
+  memset(pos, 0, sizeof(pos));
+  for (i = 0; i < n; i++)
+    pos[(r[i].prefix >> shift) & 0xff]++;
+  bucketstart[0] = 0;
+  for (b = 0; b < 256; b++) {
+    bucketstart[b + 1] = bucketstart[b] + pos[b];
+    if (pos[b] > pos[largest])
+      largest = b;
+  }
+  if (pos[largest] == n)
+    return largest;   /* all records in one bucket, no need to move them */
+  for (b = 0; b < 256; b++)
+    pos[b] = bucketstart[b];
+  for (i = 0; i < n; i++)
+    aux[pos[(r[i].prefix >> shift) & 0xff]++] = r[i];
+  memcpy(r, aux, n * sizeof(r[0]));
+  return largest;
+}
+
+/* Sorts records whose keys are equal before byte 'byte' of the prefix at
+   'depth'. Smaller buckets are sorted recursively and the largest one in
+   the loop, which keeps the recursion depth logarithmic. */
+static void rl_msd_sort(const struct rl_sort_ctx *ctx, struct rl_sortrec *r,
+			struct rl_sortrec *aux, size_t n, int byte, size_t depth)
+{
+  size_t bucketstart[257];
+  size_t ended;
+  int largest;
+  int b;
+
+  while (n >= RL_SORT_SMALL) {
+    if (byte == 8) {
+      ended = rl_sort_deeper(ctx, r, aux, n, depth);
+      r += ended;
+      aux += ended;
+      n -= ended;
+      byte = 0;
+      depth += 8;
+      continue;
+    }
+    largest = rl_radix_pass(r, aux, n, byte, bucketstart);
+    for (b = 0; b < 256; b++) {
+      if (b != largest && bucketstart[b + 1] - bucketstart[b] > 1)
+	rl_msd_sort(ctx, r + bucketstart[b], aux + bucketstart[b],
+		    bucketstart[b + 1] - bucketstart[b], byte + 1, depth);
+    }
+    r += bucketstart[largest];
+    aux += bucketstart[largest];
+    n = bucketstart[largest + 1] - bucketstart[largest];
+    byte++;
+  }
+  rl_sort_insertion(ctx, r, n, depth);
+}
+
+struct rl_sort_part {
+  struct rl_sort_ctx *ctx;
+  struct rl_sortrec *recs;
+  int thread;
+};
+
+/* Loads the prefixes of a slice of the index */
+static void rl_sort_load(const struct rl_sort_ctx *ctx, struct rl_sortrec *recs,
+			 size_t first, size_t last)
+{
+  const char *key;
+  size_t keylen;
+  size_t i;
+  for (i = first; i < last; i++) {
+    rl_sort_key(ctx, i, &key, &keylen);
+    recs[i].line = i;
+    if (ctx->mode == RL_SORT_NUMERIC)
+      recs[i].prefix = rl_sort_numeric(key, keylen);
+    else
+      recs[i].prefix = rl_sort_prefix(key, keylen, 0);
+  }
+}
+
+static void *rl_sort_load_thread(void *arg)
+{
+  struct rl_sort_part *part = arg;
+  size_t n = part->ctx->idx->n;
+  size_t first = n / rl_threads * part->thread;
+  size_t last = (part->thread == rl_threads - 1) ? n : n / rl_threads * (part->thread + 1);
+  rl_sort_load(part->ctx, part->recs, first, last);
+  return NULL;
+}
+
+static void *rl_sort_bucket_thread(void *arg)
+{
+  struct rl_sort_part *part = arg;
+  struct rl_sort_ctx *ctx = part->ctx;
+  size_t b;
+  while ((b = __sync_fetch_and_add(&ctx->nextbucket, 1)) < 256) {
+    rl_msd_sort(ctx, part->recs + ctx->bucketstart[b], ctx->aux + ctx->bucketstart[b],
+		ctx->bucketstart[b + 1] - ctx->bucketstart[b], 1, 0);
+  }
+  return NULL;
+}
+
+/* Sorts the records of all lines of ctx->idx and reorders the index to
+   match. If 'load' is non-zero, the prefixes are loaded from the keys
+   first, otherwise the caller has filled them in. With several threads,
+   the prefixes are loaded in parallel, the first radix pass is done by
+   one thread and the 256 top level buckets are then sorted in parallel. */
+static int rl_sort_records(struct rl_sort_ctx *ctx, struct rl_sortrec *recs,
+			   int load)
+{
+  struct rl_index *idx = (struct rl_index *) ctx->idx;
+  struct rl_sort_part *parts = NULL;
+  size_t entry = idx->wide ? sizeof(idx->l64[0]) : sizeof(idx->l32[0]);
+  void *sorted = NULL;
+  size_t i;
+  int t;
+  int ok = 0;
+
+  ctx->aux = malloc(sizeof(ctx->aux[0]) * idx->n);
+  sorted = malloc(entry * idx->max);
+  if (!ctx->aux || !sorted) {
+    perror("no memory for sorting");
+    goto out;
+  }
+
+  if (rl_threads > 1 && idx->n >= RL_PARALLEL_MIN_LINES) {
+    if (!(parts = malloc(sizeof(parts[0]) * rl_threads))) {
+      perror("no memory for sorting");
+      goto out;
+    }
+    for (t = 0; t < rl_threads; t++) {
+      parts[t].ctx = ctx;
+      parts[t].recs = recs;
+      parts[t].thread = t;
+    }
+    if (load)
+      rl_run_threads(rl_threads, rl_sort_load_thread, parts, sizeof(parts[0]));
+    rl_radix_pass(recs, ctx->aux, idx->n, 0, ctx->bucketstart);
+    rl_run_threads(rl_threads, rl_sort_bucket_thread, parts, sizeof(parts[0]));
+  } else {
+    if (load)
+      rl_sort_load(ctx, recs, 0, idx->n);
+    rl_msd_sort(ctx, recs, ctx->aux, idx->n, 0, 0);
+  }
+
+  for (i = 0; i < idx->n; i++) {
+    if (idx->wide)
+      ((struct rl_line64 *) sorted)[i] = idx->l64[recs[i].line];
+    else
+      ((struct rl_line32 *) sorted)[i] = idx->l32[recs[i].line];
+  }
+  if (idx->wide) {
+    free(idx->l64);
+    idx->l64 = sorted;
+  } else {
+    free(idx->l32);
+    idx->l32 = sorted;
+  }
+  sorted = NULL;
+  ok = 1;
+
+  out:
+  free(ctx->aux);
+  ctx->aux = NULL;
+  free(sorted);
+  free(parts);
+  return ok;
+}
+
+static void rl_sort_ctx_init(struct rl_sort_ctx *ctx, struct rl_index *idx,
+			     const struct rl_arena *arena, int mode,
+			     size_t field, int fieldsep)
+{
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->idx = idx;
+  ctx->arena = arena;
+  ctx->mode = mode;
+  ctx->field = field;
+  ctx->fieldsep = fieldsep;
+}
+
+/* Sorts the index by the key of each line */
+static int rl_sort_index(struct rl_index *idx, const struct rl_arena *arena,
+			 int mode, size_t field, int fieldsep)
+{
+  struct rl_sort_ctx ctx;
+  struct rl_sortrec *recs;
+  int ok;
+
+  rl_sort_ctx_init(&ctx, idx, arena, mode, field, fieldsep);
+  if (!(recs = malloc(sizeof(recs[0]) * idx->n))) {
+    perror("no memory for sorting");
+    return 0;
+  }
+  ok = rl_sort_records(&ctx, recs, 1);
+  free(recs);
+  return ok;
+}
+
+/* Deduplication. Lines are hashed with a wyhash style function that
+   reads 8 bytes at a time and mixes them with 64x64->128 bit multiplies.
+   The set is an open-addressing table of index positions (plus one, 0 is
+   an empty slot) with linear probing, so it costs 4 or 8 bytes per slot
+   and no allocation per line. The index is compacted in place while it
+   is scanned, keeping the first occurrence of each line. */
+
+static inline uint64_t rl_mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t) a * b;
+  return ((uint64_t) r) ^ ((uint64_t) (r >> 64));
+#else
+  uint64_t ha = a >> 32, la = (uint32_t) a;
+  uint64_t hb = b >> 32, lb = (uint32_t) b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t lo = t + (rm1 << 32);
+  uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+  return lo ^ hi;
+#endif
+}
+
+static inline uint64_t rl_read64(const char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Reads 1 to 7 bytes */
+static inline uint64_t rl_read_tail(const char *p, size_t len)
+{
+  uint64_t v = 0;
+  memcpy(&v, p, len);
+  return v;
+}
+
+static uint64_t rl_hash(const char *p, size_t len)
+{
+  const uint64_t k0 = 0xa0761d6478bd642fULL;
+  const uint64_t k1 = 0xe7037ed1a0b428dbULL;
+  const uint64_t k2 = 0x8ebc6af09c88c6e3ULL;
+  uint64_t seed = k0 ^ len;
+  uint64_t see1 = seed;
+  size_t left = len;
+
+  while (left >= 16) {
+    seed = rl_mum(rl_read64(p) ^ k1, rl_read64(p + 8) ^ seed);
+    see1 = rl_mum(see1 ^ k2, seed);
+    p += 16;
+    left -= 16;
+  }
+  if (left >= 8) {
+    seed = rl_mum(rl_read64(p) ^ k1, rl_read64(p + left - 8) ^ seed);
+  } else if (left > 0) {
+    seed = rl_mum(rl_read_tail(p, left) ^ k1, seed);
+  }
+  return rl_mum(seed ^ see1, k2 ^ len);
+}
+
+static inline void rl_index_move(struct rl_index *idx, size_t dst, size_t src)
+{
+  if (idx->wide)
+    idx->l64[dst] = idx->l64[src];
+  else
+    idx->l32[dst] = idx->l32[src];
+}
+
+static inline uint64_t rl_line_hash(const struct rl_index *idx,
+				  const struct rl_arena *a, size_t i)
+{
+  return rl_hash(rl_arena_ptr(a, rl_line_offs(idx, i)), rl_line_len(idx, i));
+}
+
+/* Removes repeated lines from the index. The hashes of the lines
+   RL_PREFETCH_DIST entries ahead are computed early and their table
+   slots prefetched. */
+static int rl_unique_index(struct rl_index *idx, const struct rl_arena *a)
+{
+  uint64_t hashes[RL_PREFETCH_DIST];
+  uint32_t *t32 = NULL;
+  uint64_t *t64 = NULL;
+  size_t slots = 16;
+  size_t mask;
+  size_t kept = 0;
+  size_t i, j;
+  size_t pos;
+  size_t len;
+  const char *line;
+  uint64_t h;
+  int found;
+
+  while (slots < idx->n * 2)
+    slots *= 2;
+  mask = slots - 1;
+  if (idx->wide)
+    t64 = calloc(slots, sizeof(t64[0]));
+  else
+    t32 = calloc(slots, sizeof(t32[0]));
+  if (t32 == NULL && t64 == NULL) {
+    perror("no memory for unique lines");
+    return 0;
+  }
+  rl_advise_huge(idx->wide ? (void *) t64 : (void *) t32,
+		 slots * (idx->wide ? sizeof(t64[0]) : sizeof(t32[0])));
+
+  for (i = 0; i < RL_PREFETCH_DIST && i < idx->n; i++)
+    hashes[i] = rl_line_hash(idx, a, i);
+
+  for (i = 0; i < idx->n; i++) {
+    h = hashes[i % RL_PREFETCH_DIST];
+    if (i + RL_PREFETCH_DIST < idx->n) {
+      uint64_t ahead = rl_line_hash(idx, a, i + RL_PREFETCH_DIST);
+      hashes[i % RL_PREFETCH_DIST] = ahead;
+      if (idx->wide)
+	__builtin_prefetch(&t64[ahead & mask]);
+      else
+	__builtin_prefetch(&t32[ahead & mask]);
+    }
+    line = rl_arena_ptr(a, rl_line_offs(idx, i));
+    len = rl_line_len(idx, i);
+    found = 0;
+    for (j = h & mask; ; j = (j + 1) & mask) {
+      pos = idx->wide ? t64[j] : t32[j];
+      if (pos == 0)
+	break;
+      pos--;
+      if (rl_line_len(idx, pos) == len &&
+	  memcmp(rl_arena_ptr(a, rl_line_offs(idx, pos)), line, len) == 0) {
+	found = 1;
+	break;
+      }
+    }
+    if (found)
+      continue;   /* a repeated line */
+    rl_index_move(idx, kept, i);
+    if (idx->wide)
+      t64[j] = kept + 1;
+    else
+      t32[j] = kept + 1;
+    kept++;
+  }
+  idx->n = kept;
+  free(t32);
+  free(t64);
+  return 1;
+}
+
+
+/* Weighted and stratified random order. Both give each line a random
+   sort key in the prefix of its record and sort the records with the
+   radix sort above, so only the index is reordered and line data is
+   read just for the weight or group field.
+
+   Weighted order is the Efraimidis-Spirakis method: a line of weight w
+   gets the key -log(u) / w, an exponential variable of rate w, and the
+   lines are printed in increasing key order. The first line is then
+   chosen with probability proportional to its weight, the next one from
+   the rest in the same way, and so on. Positive doubles sort in the
+   order of their bits, so the keys go to the prefix as they are. Lines
+   with a missing or non-positive weight get keys above all others and
+   are printed last in random order.
+
+   Stratified order groups the lines by the value of a field. The index
+   is shuffled first, so the lines of a group are in random order, and
+   line r of a group of n lines gets the key (r + o) / n, where o is a
+   random offset of the group in (0, 1). Groups of the same size are
+   thus interleaved round-robin, and each group is spread evenly through
+   the output whatever its size. */
+
+/* Keys of lines without a weight: the bits of +infinity and above */
+#define RL_NO_WEIGHT 0x7ff0000000000000ULL
+
+/* Parses the leading number of a weight field. Returns 0 if there is no
+   number or it is not positive and finite. */
+static double rl_weight(const char *key, size_t keylen)
+{
+  char buf[64];
+  char *end;
+  double w;
+  while (keylen > 0 && (*key == ' ' || *key == '\t')) {
+    key++;
+    keylen--;
+  }
+  if (keylen == 0)
+    return 0;
+  if (keylen >= sizeof(buf))
+    keylen = sizeof(buf) - 1;
+  memcpy(buf, key, keylen);
+  buf[keylen] = 0;
+  w = strtod(buf, &end);
+  if (end == buf || !(w > 0 && w <= DBL_MAX))
+    return 0;
+  return w;
+}
+
+/* Orders the index randomly with the weight of each line taken from
+   field 'field' */
+static int rl_weight_index(struct rl_index *idx, const struct rl_arena *a,
+			   size_t field, int fieldsep, struct rl_rng *rng)
+{
+  struct rl_sort_ctx ctx;
+  struct rl_sortrec *recs;
+  const char *key;
+  size_t keylen;
+  size_t i;
+  double w;
+  double e;
+  int ok;
+
+  rl_sort_ctx_init(&ctx, idx, a, RL_SORT_PREFIX, field, fieldsep);
+  if (!(recs = malloc(sizeof(recs[0]) * idx->n))) {
+    perror("no memory for weighted order");
+    return 0;
+  }
+  for (i = 0; i < idx->n; i++) {
+    rl_sort_key(&ctx, i, &key, &keylen);
+    w = rl_weight(key, keylen);
+    recs[i].line = i;
+    if (w > 0) {
+      e = -log(rl_rand_open01(rng)) / w;
+      memcpy(&recs[i].prefix, &e, sizeof(e));
+    } else {
+      recs[i].prefix = RL_NO_WEIGHT | (rl_rand64(rng) >> 12);
+    }
+  }
+  ok = rl_sort_records(&ctx, recs, 0);
+  free(recs);
+  return ok;
+}
+
+struct rl_stratum {
+  uint64_t hash;
+  size_t line;       /* first line of the group, for comparing keys */
+  size_t count;
+  size_t rank;       /* lines of the group given a key so far */
+  double offset;
+};
+
+/* Shuffles the index and interleaves the groups of lines that have the
+   same field 'field' */
+static int rl_stratify_index(struct rl_index *idx, const struct rl_arena *a,
+			     size_t field, int fieldsep, struct rl_rng *rng)
+{
+  struct rl_sort_ctx ctx;
+  struct rl_sortrec *recs = NULL;
+  struct rl_stratum *strata = NULL;
+  struct rl_stratum *s;
+  size_t *table = NULL;
+  size_t *newtable;
+  size_t slots = 1024;
+  size_t mask = slots - 1;
+  size_t nstrata = 0;
+  size_t maxstrata = 0;
+  const char *key;
+  const char *other;
+  size_t keylen;
+  size_t otherlen;
+  size_t i, j, k, g;
+  uint64_t h;
+  double pos;
+  void *p;
+  int ok = 0;
+
+  rl_sort_ctx_init(&ctx, idx, a, RL_SORT_PREFIX, field, fieldsep);
+  recs = malloc(sizeof(recs[0]) * idx->n);
+  table = calloc(slots, sizeof(table[0]));
+  if (!recs || !table) {
+    perror("no memory for stratified order");
+    goto out;
+  }
+
+  /* The group of each line goes to its prefix for now. Table slots hold
+     group numbers plus one, 0 is an empty slot. */
+  for (i = 0; i < idx->n; i++) {
+    rl_sort_key(&ctx, i, &key, &keylen);
+    h = rl_hash(key, keylen);
+    for (j = h & mask; table[j] != 0; j = (j + 1) & mask) {
+      s = &strata[table[j] - 1];
+      if (s->hash != h)
+	continue;
+      rl_sort_key(&ctx, s->line, &other, &otherlen);
+      if (otherlen == keylen && memcmp(other, key, keylen) == 0)
+	break;
+    }
+    if (table[j] == 0) {
+      if (nstrata == maxstrata) {
+	maxstrata = maxstrata ? maxstrata * 2 : 256;
+	if (!(p = realloc(strata, sizeof(strata[0]) * maxstrata))) {
+	  perror("no memory for stratified order");
+	  goto out;
+	}
+	strata = p;
+      }
+      s = &strata[nstrata];
+      s->hash = h;
+      s->line = i;
+      s->count = 0;
+      s->rank = 0;
+      s->offset = rl_rand_open01(rng);
+      table[j] = ++nstrata;
+      g = nstrata - 1;
+      if (nstrata * 2 > slots) {
+	/* keep the table at most half full */
+	if (!(newtable = calloc(slots * 2, sizeof(table[0])))) {
+	  perror("no memory for stratified order");
+	  goto out;
+	}
+	slots *= 2;
+	mask = slots - 1;
+	for (k = 0; k < nstrata; k++) {
+	  for (j = strata[k].hash & mask; newtable[j] != 0; j = (j + 1) & mask)
+	    ;
+	  newtable[j] = k + 1;
+	}
+	free(table);
+	table = newtable;
+      }
+    } else {
+      g = table[j] - 1;
+    }
+    strata[g].count++;
+    recs[i].line = i;
+    recs[i].prefix = g;
+  }
+
+  for (i = 0; i < idx->n; i++) {
+    s = &strata[recs[i].prefix];
+    pos = (s->rank++ + s->offset) / s->count;
+    memcpy(&recs[i].prefix, &pos, sizeof(pos));
+  }
+  ok = rl_sort_records(&ctx, recs, 0);
+
+  out:
+  free(recs);
+  free(strata);
+  free(table);
+  return ok;
+}
+
+/* Reads up to 'len' bytes, retrying on EINTR. Returns -1 on error. */
+static ssize_t rl_read(int fd, char *dst, size_t len)
+{
+  ssize_t ret;
+  while ((ret = read(fd, dst, len)) < 0) {
+    if (errno != EINTR) {
+      perror("read error");
+      break;
+    }
+  }
+  return ret;
+}
+
+/* Reads until 'len' bytes have been read or end of file */
+static ssize_t rl_read_full(int fd, char *dst, size_t len)
+{
+  size_t got = 0;
+  ssize_t ret;
+  while (got < len) {
+    ret = rl_read(fd, dst + got, len - got);
+    if (ret < 0)
+      return -1;
+    if (ret == 0)
+      break;
+    got += ret;
+  }
+  return got;
+}
+
+/* Input stage. The input is one descriptor or a list of files that are
+   read one after another as if they were concatenated. rl_input_start()
+   hands a read to a reader thread and rl_input_wait() collects it, so the
+   next block is read while the previous one is indexed. All files are
+   opened at start and the kernel is asked to read ahead the beginning of
+   each regular file, so the reads of several files are in flight at once,
+   which helps with latency-bound network filesystems. */
+#define RL_INPUT_PIECE (1024 * 1024)
+#define RL_INPUT_AHEAD (16 * 1024 * 1024)
+
+enum {
+  RL_INPUT_IDLE,
+  RL_INPUT_BUSY,     /* a read was handed to the reader thread */
+  RL_INPUT_DONE,     /* the result is ready */
+  RL_INPUT_QUIT
+};
+
+struct rl_input {
+  int *fds;
+  int nfds;
+  int cur;           /* descriptor being read */
+  int single;        /* storage for one descriptor */
+  int owned;         /* descriptors were opened by rl_input_open() */
+  int threaded;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int state;
+  char *dst;
+  size_t len;
+  ssize_t result;
+  unsigned long long bytes;  /* bytes read */
+};
+
+static void rl_input_init_fd(struct rl_input *in, int fd)
+{
+  memset(in, 0, sizeof(*in));
+  in->single = fd;
+  in->fds = &in->single;
+  in->nfds = 1;
+}
+
+/* Opens all files, "-" being stdin */
+static int rl_input_open(struct rl_input *in, char **files, int nfiles)
+{
+  struct stat st;
+  int i;
+  memset(in, 0, sizeof(*in));
+  in->owned = 1;
+  if (!(in->fds = malloc(sizeof(in->fds[0]) * nfiles))) {
+    perror("no memory for input files");
+    return 0;
+  }
+  for (i = 0; i < nfiles; i++) {
+    if (strcmp(files[i], "-") == 0) {
+      in->fds[i] = STDIN_FILENO;
+    } else if ((in->fds[i] = open(files[i], O_RDONLY)) < 0) {
+      fprintf(stderr, "can not open %s: %s\n", files[i], strerror(errno));
+      return 0;
+    }
+    in->nfds++;
+    if (fstat(in->fds[i], &st) == 0 && S_ISREG(st.st_mode)) {
+      posix_fadvise(in->fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+      posix_fadvise(in->fds[i], 0, RL_INPUT_AHEAD, POSIX_FADV_WILLNEED);
+    }
+  }
+  return 1;
+}
+
+/* Reads up to 'len' bytes, moving to the next file at end of file.
+   Returns 0 at the end of the last file and -1 on error. */
+static ssize_t rl_input_read(struct rl_input *in, char *dst, size_t len)
+{
+  ssize_t ret;
+  while (in->cur < in->nfds) {
+    ret = rl_read(in->fds[in->cur], dst, len);
+    if (ret > 0)
+      in->bytes += ret;
+    if (ret != 0)
+      return ret;
+    in->cur++;
+  }
+  return 0;
+}
+
+/* Reads until 'len' bytes have been read or end of input */
+static ssize_t rl_input_read_full(struct rl_input *in, char *dst, size_t len)
+{
+  size_t got = 0;
+  ssize_t ret;
+  while (got < len) {
+    ret = rl_input_read(in, dst + got, len - got);
+    if (ret < 0)
+      return -1;
+    if (ret == 0)
+      break;
+    got += ret;
+  }
+  return got;
+}
+
+/* Size of the next read into chunk 'c' */
+static inline size_t rl_input_piece(const struct rl_chunk *c)
+{
+  size_t left = c->size - c->len;
+  return left < RL_INPUT_PIECE ? left : RL_INPUT_PIECE;
+}
+
+static void *rl_input_thread(void *arg)
+{
+  struct rl_input *in = arg;
+  ssize_t ret;
+  pthread_mutex_lock(&in->lock);
+  while (1) {
+    while (in->state != RL_INPUT_BUSY && in->state != RL_INPUT_QUIT)
+      pthread_cond_wait(&in->cond, &in->lock);
+    if (in->state == RL_INPUT_QUIT)
+      break;
+    pthread_mutex_unlock(&in->lock);
+    ret = rl_input_read(in, in->dst, in->len);
+    pthread_mutex_lock(&in->lock);
+    in->result = ret;
+    in->state = RL_INPUT_DONE;
+    pthread_cond_broadcast(&in->cond);
+  }
+  pthread_mutex_unlock(&in->lock);
+  return NULL;
+}
+
+/* Starts reading up to 'len' bytes into 'dst' in the background. If the
+   reader thread can not be created, the read is done right away. */
+static void rl_input_start(struct rl_input *in, char *dst, size_t len)
+{
+  if (!in->threaded) {
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->cond, NULL);
+    if (pthread_create(&in->thread, NULL, rl_input_thread, in)) {
+      pthread_mutex_destroy(&in->lock);
+      pthread_cond_destroy(&in->cond);
+      in->result = rl_input_read(in, dst, len);
+      in->state = RL_INPUT_DONE;
+      return;
+    }
+    in->threaded = 1;
+  }
+  pthread_mutex_lock(&in->lock);
+  in->dst = dst;
+  in->len = len;
+  in->state = RL_INPUT_BUSY;
+  pthread_cond_broadcast(&in->cond);
+  pthread_mutex_unlock(&in->lock);
+}
+
+/* Waits for the read started by rl_input_start() and returns its result */
+static ssize_t rl_input_wait(struct rl_input *in)
+{
+  ssize_t ret;
+  if (!in->threaded) {
+    in->state = RL_INPUT_IDLE;
+    return in->result;
+  }
+  pthread_mutex_lock(&in->lock);
+  while (in->state != RL_INPUT_DONE)
+    pthread_cond_wait(&in->cond, &in->lock);
+  in->state = RL_INPUT_IDLE;
+  ret = in->result;
+  pthread_mutex_unlock(&in->lock);
+  return ret;
+}
+
+static void rl_input_close(struct rl_input *in)
+{
+  int i;
+  if (in->threaded) {
+    pthread_mutex_lock(&in->lock);
+    while (in->state == RL_INPUT_BUSY)
+      pthread_cond_wait(&in->cond, &in->lock);
+    in->state = RL_INPUT_QUIT;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+    pthread_join(in->thread, NULL);
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->cond);
+  }
+  if (in->owned) {
+    for (i = 0; i < in->nfds; i++) {
+      if (in->fds[i] != STDIN_FILENO)
+	close(in->fds[i]);
+    }
+    free(in->fds);
+  }
+  memset(in, 0, sizeof(*in));
+}
+
+static int rl_write_full(int fd, const char *src, size_t len)
+{
+  ssize_t ret;
+  while (len > 0) {
+    ret = write(fd, src, len);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("temporary file write error");
+      return 0;
+    }
+    src += ret;
+    len -= ret;
+  }
+  return 1;
+}
+
+/* Creates an anonymous temporary file in $TMPDIR (or /tmp) */
+static int rl_tmpfd(void)
+{
+  const char *dir = getenv("TMPDIR");
+  char *path;
+  int fd;
+  if (dir == NULL || *dir == 0)
+    dir = "/tmp";
+  if (!(path = malloc(strlen(dir) + 32))) {
+    fprintf(stderr, "no memory for temporary file name\n");
+    return -1;
+  }
+  sprintf(path, "%s/orderlines.XXXXXX", dir);
+  fd = mkstemp(path);
+  if (fd < 0)
+    fprintf(stderr, "can not create temporary file %s: %s\n", path, strerror(errno));
+  else
+    unlink(path);
+  free(path);
+  return fd;
+}
+
+/* Outputs the lines of buf[0 .. len - 1] in reverse order. The last line
+   need not be terminated with a separator. */
+static int rl_output_reverse(struct rl_output *out, const char *buf,
+			     size_t len, char separator)
+{
+  const char *p;
+  size_t lineend;
+  size_t start;
+  if (len == 0)
+    return 1;
+  lineend = (buf[len - 1] == separator) ? len - 1 : len;
+  while (1) {
+    p = lineend > 0 ? memrchr(buf, separator, lineend) : NULL;
+    start = p ? (size_t) (p - buf) + 1 : 0;
+    if (!rl_output_line(out, buf + start, lineend - start, lineend < len))
+      return 0;
+    if (!p)
+      break;
+    lineend = p - buf;
+  }
+  return 1;
+}
+
+/* Grows an external mode buffer when a single line does not fit into it */
+static int rl_grow_buffer(char **buf, size_t *size)
+{
+  char *newbuf = realloc(*buf, *size * 2);
+  if (!newbuf) {
+    perror("no realloc memory");
+    return 0;
+  }
+  *buf = newbuf;
+  *size *= 2;
+  return 1;
+}
+
+/* Block size for reading seekable files backwards */
+#define RL_BACKWARD_BLOCK (1024 * 1024)
+
+/* Prints the lines of a seekable file in reverse order by reading it in
+   blocks from the end towards 'start' (tac style). A line that crosses a
+   block boundary is kept at the front of the buffer until the block that
+   contains its beginning has been read. Memory use is one block unless a
+   single line is longer than that. */
+static int rl_reverse_backward(struct rl_output *out, int fd, off_t start,
+			       off_t end, char separator)
+{
+  size_t cap = RL_BACKWARD_BLOCK;
+  size_t n = 0;    /* bytes of data at the end of the buffer */
+  size_t keep;
+  size_t k;
+  off_t pos = end;
+  char *buf;
+  char *region;
+  char *p;
+  ssize_t ret;
+
+  if (!(buf = malloc(cap))) {
+    perror("no memory for reverse buffer");
+    return 0;
+  }
+
+  while (pos > start) {
+    if (n == cap) {
+      /* a line longer than the buffer */
+      char *newbuf = malloc(cap * 2);
+      if (!newbuf) {
+	perror("no memory for reverse buffer");
+	goto error;
+      }
+      memcpy(newbuf + cap * 2 - n, buf + cap - n, n);
+      free(buf);
+      buf = newbuf;
+      cap *= 2;
+    }
+
+    k = cap - n;
+    if (((uintmax_t) (pos - start)) < k)
+      k = pos - start;
+    pos -= k;
+    region = buf + cap - n - k;
+    ret = pread(fd, region, k, pos);
+    if (ret != (ssize_t) k) {
+      if (ret < 0)
+	perror("read error");
+      else
+	fprintf(stderr, "input file changed while reading\n");
+      goto error;
+    }
+    n += k;
+
+    /* let the kernel read the next block ahead */
+    if (pos > start) {
+      off_t ahead = (pos - start) < RL_BACKWARD_BLOCK ? (pos - start) : RL_BACKWARD_BLOCK;
+      posix_fadvise(fd, pos - ahead, ahead, POSIX_FADV_WILLNEED);
+    }
+
+    if (pos == start) {
+      if (!rl_output_reverse(out, region, n, separator))
+	goto error;
+      n = 0;
+      break;
+    }
+
+    /* the first line of the region may continue in the previous block */
+    p = memchr(region, separator, n);
+    if (p == NULL)
+      continue;
+    keep = (p - region) + 1;
+    if (!rl_output_reverse(out, region + keep, n - keep, separator))
+      goto error;
+    if (!rl_output_flush(out))
+      goto error;
+    memmove(buf + cap - keep, region, keep);
+    n = keep;
+  }
+
+  if (!rl_output_flush(out))
+    goto error;
+  free(buf);
+  return 1;
+
+  error:
+  free(buf);
+  return 0;
+}
+
+struct rl_spill_chunk {
+  off_t pos;
+  size_t len;
+};
+
+struct rl_spill {
+  int fd;
+  struct rl_spill_chunk *chunks;
+  size_t nchunks;
+  size_t maxchunks;
+  off_t pos;
+};
+
+/* Writes a chunk of complete lines to the spill file */
+static int rl_spill_add(struct rl_spill *s, const char *data, size_t len)
+{
+  if (s->nchunks == s->maxchunks) {
+    struct rl_spill_chunk *newchunks;
+    size_t newmax = s->maxchunks ? s->maxchunks * 2 : 64;
+    newchunks = realloc(s->chunks, sizeof(s->chunks[0]) * newmax);
+    if (!newchunks) {
+      perror("no memory for chunk list");
+      return 0;
+    }
+    s->chunks = newchunks;
+    s->maxchunks = newmax;
+  }
+  if (!rl_write_full(s->fd, data, len))
+    return 0;
+  s->chunks[s->nchunks].pos = s->pos;
+  s->chunks[s->nchunks].len = len;
+  s->nchunks++;
+  s->pos += len;
+  return 1;
+}
+
+/* External memory reverse. 'prefix' holds the input already read from
+   'in'. Input is spilled to a temporary file in chunks of complete lines
+   that are at most 'budget' bytes. The part in memory at end of file is
+   printed first and the spilled chunks are then read back from last to
+   first and printed in reverse. */
+static int rl_external_reverse(struct rl_output *out, struct rl_input *in,
+			       struct rl_arena *prefix, size_t budget,
+			       char separator)
+{
+  struct rl_spill spill;
+  size_t size;
+  size_t used;
+  size_t i;
+  int eof = 0;
+  int ok = 0;
+  char *buf;
+  char *p;
+  size_t cut;
+  ssize_t ret;
+
+  memset(&spill, 0, sizeof(spill));
+  buf = rl_arena_detach_last(prefix, &used, &size);
+  if ((spill.fd = rl_tmpfd()) < 0)
+    goto out;
+  for (i = 0; i < prefix->nchunks; i++) {
+    if (!rl_spill_add(&spill, prefix->chunks[i].data, prefix->chunks[i].len))
+      goto out;
+  }
+  rl_arena_free(prefix);
+
+  if (size < budget / 2)
+    size = budget / 2;
+  if (!(p = realloc(buf, size))) {
+    perror("no memory for external reverse");
+    goto out;
+  }
+  buf = p;
+
+  while (1) {
+    if (!eof && used < size) {
+      ret = rl_input_read_full(in, buf + used, size - used);
+      if (ret < 0)
+	goto out;
+      used += ret;
+      eof = (used < size);
+    }
+    if (eof)
+      break;
+
+    p = memrchr(buf, separator, used);
+    if (p == NULL) {
+      if (!rl_grow_buffer(&buf, &size))
+	goto out;
+      continue;
+    }
+    cut = (p - buf) + 1;
+    if (!rl_spill_add(&spill, buf, cut))
+      goto out;
+    memmove(buf, buf + cut, used - cut);
+    used -= cut;
+  }
+
+  if (!rl_output_reverse(out, buf, used, separator))
+    goto out;
+
+  while (spill.nchunks > 0) {
+    struct rl_spill_chunk *c = &spill.chunks[--spill.nchunks];
+    if (!rl_output_flush(out))
+      goto out;
+    while (c->len > size) {
+      if (!rl_grow_buffer(&buf, &size))
+	goto out;
+    }
+    if (pread(spill.fd, buf, c->len, c->pos) != (ssize_t) c->len) {
+      perror("temporary file read error");
+      goto out;
+    }
+    if (!rl_output_reverse(out, buf, c->len, separator))
+      goto out;
+  }
+  ok = rl_output_flush(out);
+
+  out:
+  rl_arena_free(prefix);
+  if (spill.fd >= 0)
+    close(spill.fd);
+  free(spill.chunks);
+  free(buf);
+  return ok;
+}
+
+/* Nesting limit for splitting oversized buckets. A bucket can only stay
+   oversized after that if it is made of a few huge lines, in which case it
+   is shuffled in memory anyway. */
+#define RL_MAX_SCATTER_DEPTH 8
+
+static int rl_external_randomize(struct rl_output *out, struct rl_input *in,
+				 struct rl_arena *prefix, size_t budget,
+				 size_t insize, char separator, int depth);
+
+/* Shuffles one bucket file. Buckets that fit into the budget are shuffled
+   in memory, others are scattered again. */
+static int rl_shuffle_bucket(struct rl_output *out, int fd, size_t budget,
+			     char separator, int depth)
+{
+  struct rl_index idx;
+  struct rl_arena a;
+  off_t size;
+  char *buf;
+
+  if ((size = lseek(fd, 0, SEEK_END)) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+    perror("temporary file seek error");
+    return 0;
+  }
+  if (size == 0)
+    return 1;
+
+  if (((uintmax_t) size) > budget / 2 && depth < RL_MAX_SCATTER_DEPTH) {
+    struct rl_input in;
+    rl_input_init_fd(&in, fd);
+    return rl_external_randomize(out, &in, NULL, budget, size, separator, depth + 1);
+  }
+
+  if (!(buf = malloc(size))) {
+    perror("no memory for bucket");
+    return 0;
+  }
+  if (rl_read_full(fd, buf, size) != size) {
+    fprintf(stderr, "temporary file read error\n");
+    free(buf);
+    return 0;
+  }
+  memset(&idx, 0, sizeof(idx));
+  if (!rl_arena_wrap(&a, buf, size, RL_ARENA_BORROWED))
+    goto error;
+  if (!rl_index_scan(&idx, buf, size, 0, separator) || !rl_index_finish(&idx, size)) {
+    rl_arena_free(&a);
+    goto error;
+  }
+  rl_shuffle_index(&idx, &rl_rng);
+  if (!rl_output_index(out, &idx, &a, 0)) {
+    rl_arena_free(&a);
+    goto error;
+  }
+  rl_arena_free(&a);
+  rl_index_free(&idx);
+  free(buf);
+  return 1;
+
+  error:
+  rl_index_free(&idx);
+  free(buf);
+  return 0;
+}
+
+/* Writes each line of data[0 .. len - 1] into a uniformly chosen bucket */
+static int rl_scatter_lines(FILE **buckets, size_t nbuckets, const char *data,
+			    size_t len, char separator)
+{
+  const char *line = data;
+  const char *end = data + len;
+  const char *p;
+  FILE *f;
+  while (line < end) {
+    f = buckets[rl_rand_range(&rl_rng, nbuckets)];
+    p = memchr(line, separator, end - line);
+    if (p == NULL)
+      p = end;
+    if (fwrite(line, 1, p - line, f) != (size_t) (p - line) || putc(separator, f) == EOF) {
+      perror("bucket write error");
+      return 0;
+    }
+    line = p + 1;
+  }
+  return 1;
+}
+
+/* External memory shuffle. Each line is written to a uniformly chosen
+   temporary bucket file, then every bucket is shuffled on its own and the
+   buckets are printed one after another. This gives a uniform permutation.
+   'prefix' holds the input already read from 'in', or is NULL. 'insize'
+   is the input size if known, otherwise 0. */
+static int rl_external_randomize(struct rl_output *out, struct rl_input *in,
+				 struct rl_arena *prefix, size_t budget,
+				 size_t insize, char separator, int depth)
+{
+  FILE **buckets = NULL;
+  size_t nbuckets;
+  size_t bufsize;
+  size_t size = budget / 2;
+  size_t used = 0;
+  size_t i;
+  int eof = 0;
+  int ok = 0;
+  char *buf = NULL;
+  char *p;
+  size_t cut;
+  ssize_t ret;
+
+  /* aim at buckets of a quarter of the budget */
+  nbuckets = insize ? insize / (budget / 4) + 1 : 64;
+  if (nbuckets < 2)
+    nbuckets = 2;
+  if (nbuckets > 256)
+    nbuckets = 256;
+  bufsize = budget / (4 * nbuckets);
+  if (bufsize > 65536)
+    bufsize = 65536;
+  if (bufsize < 4096)
+    bufsize = 4096;
+
+  if (!(buckets = calloc(nbuckets, sizeof(buckets[0])))) {
+    perror("no memory for buckets");
+    goto out;
+  }
+  for (i = 0; i < nbuckets; i++) {
+    int fd = rl_tmpfd();
+    if (fd < 0)
+      goto out;
+    if (!(buckets[i] = fdopen(fd, "w+"))) {
+      perror("can not open bucket");
+      close(fd);
+      goto out;
+    }
+    setvbuf(buckets[i], NULL, _IOFBF, bufsize);
+  }
+
+  if (prefix) {
+    size_t prefixsize;
+    buf = rl_arena_detach_last(prefix, &used, &prefixsize);
+    for (i = 0; i < prefix->nchunks; i++) {
+      if (!rl_scatter_lines(buckets, nbuckets, prefix->chunks[i].data,
+			    prefix->chunks[i].len, separator))
+	goto out;
+    }
+    rl_arena_free(prefix);
+    if (size < used)
+      size = used;
+  }
+  if (!(p = realloc(buf, size))) {
+    perror("no memory for external shuffle");
+    goto out;
+  }
+  buf = p;
+
+  while (!eof || used > 0) {
+    if (!eof && used < size) {
+      ret = rl_input_read_full(in, buf + used, size - used);
+      if (ret < 0)
+	goto out;
+      used += ret;
+      eof = (used < size);
+    }
+
+    p = memrchr(buf, separator, used);
+    if (p) {
+      cut = (p - buf) + 1;
+    } else if (eof) {
+      cut = used;
+    } else {
+      if (!rl_grow_buffer(&buf, &size))
+	goto out;
+      continue;
+    }
+
+    if (!rl_scatter_lines(buckets, nbuckets, buf, cut, separator))
+      goto out;
+
+    memmove(buf, buf + cut, used - cut);
+    used -= cut;
+  }
+
+  free(buf);
+  buf = NULL;
+
+  for (i = 0; i < nbuckets; i++) {
+    if (fflush(buckets[i])) {
+      perror("bucket write error");
+      goto out;
+    }
+    if (!rl_shuffle_bucket(out, fileno(buckets[i]), budget, separator, depth))
+      goto out;
+    fclose(buckets[i]);
+    buckets[i] = NULL;
+  }
+  ok = 1;
+
+  out:
+  if (prefix)
+    rl_arena_free(prefix);
+  if (buckets) {
+    for (i = 0; i < nbuckets; i++) {
+      if (buckets[i])
+	fclose(buckets[i]);
+    }
+    free(buckets);
+  }
+  free(buf);
+  return ok;
+}
+
+
+/* Streaming line reader for the modes that print while reading. Lines are
+   returned one by one from a buffer that is refilled with one read() call
+   at a time, so lines are handed out as soon as they arrive. */
+#define RL_READER_SIZE (64 * 1024)
+
+struct rl_reader {
+  struct rl_input *in;
+  char separator;
+  char *buf;
+  size_t size;
+  size_t start;              /* first unread byte */
+  size_t end;                /* end of data */
+  size_t scanned;            /* bytes after start known not to be separators */
+  int eof;
+  struct rl_output *flush;   /* flushed before a read that may block */
+};
+
+static int rl_reader_init(struct rl_reader *r, struct rl_input *in, char separator)
+{
+  memset(r, 0, sizeof(*r));
+  r->in = in;
+  r->separator = separator;
+  r->size = RL_READER_SIZE;
+  if (!(r->buf = malloc(r->size))) {
+    perror("no memory for line reader");
+    return 0;
+  }
+  return 1;
+}
+
+/* Returns the next line without the separator in 'line' and 'len'. The
+   line stays valid until the next call. Returns 1 if a line was returned,
+   0 at end of input and -1 on error. */
+static int rl_reader_next(struct rl_reader *r, const char **line, size_t *len)
+{
+  char *p;
+  ssize_t ret;
+  while (1) {
+    p = memchr(r->buf + r->start + r->scanned, r->separator, r->end - r->start - r->scanned);
+    if (p) {
+      *line = r->buf + r->start;
+      *len = p - *line;
+      r->start = (p - r->buf) + 1;
+      r->scanned = 0;
+      return 1;
+    }
+    r->scanned = r->end - r->start;
+    if (r->eof) {
+      if (r->start == r->end)
+	return 0;
+      *line = r->buf + r->start;
+      *len = r->end - r->start;
+      r->start = r->end;
+      r->scanned = 0;
+      return 1;
+    }
+
+    /* move the partial line to the front, or grow if it fills the buffer */
+    if (r->start > 0) {
+      memmove(r->buf, r->buf + r->start, r->end - r->start);
+      r->end -= r->start;
+      r->start = 0;
+    } else if (r->end == r->size) {
+      if (!rl_grow_buffer(&r->buf, &r->size))
+	return -1;
+    }
+
+    if (r->flush && !rl_output_flush(r->flush))
+      return -1;
+    ret = rl_input_read(r->in, r->buf + r->end, r->size - r->end);
+    if (ret < 0)
+      return -1;
+    if (ret == 0)
+      r->eof = 1;
+    r->end += ret;
+  }
+}
+
+static void rl_reader_free(struct rl_reader *r)
+{
+  free(r->buf);
+  r->buf = NULL;
+}
+
+struct rl_sample_line {
+  char *data;
+  size_t len;
+};
+
+/* Prints k uniformly chosen lines of the input in random order, using
+   memory for k lines only. This is reservoir sampling with Li's Algorithm
+   L: instead of drawing a random number for every line, the number of
+   lines to skip before the next replacement is drawn directly, so the
+   random generator cost grows with k * log(n / k) instead of n. */
+static int rl_sample_lines(struct rl_output *out, struct rl_input *in, size_t k,
+			   char separator)
+{
+  struct rl_reader r;
+  struct rl_sample_line *sample;
+  struct rl_sample_line tmp;
+  const char *line;
+  size_t len;
+  size_t n = 0;          /* number of lines in the reservoir */
+  size_t seen = 0;       /* number of lines read */
+  size_t next = 0;       /* number of the next line to put in the reservoir */
+  size_t i, j;
+  double w = 0;
+  char *copy;
+  int ret;
+  int ok = 0;
+
+  if (!rl_reader_init(&r, in, separator))
+    return 0;
+  if (!(sample = calloc(k, sizeof(sample[0])))) {
+    perror("no memory for sample");
+    rl_reader_free(&r);
+    return 0;
+  }
+
+  while ((ret = rl_reader_next(&r, &line, &len)) > 0) {
+    seen++;
+    if (n == k && seen != next)
+      continue;
+
+    if (!(copy = malloc(len ? len : 1))) {
+      perror("no memory for sample line");
+      goto out;
+    }
+    memcpy(copy, line, len);
+
+    if (n < k) {
+      j = n++;
+    } else {
+      j = rl_rand_range(&rl_rng, k);
+      free(sample[j].data);
+    }
+    sample[j].data = copy;
+    sample[j].len = len;
+
+    if (n == k) {
+      double skip;
+      if (seen == k)
+	w = exp(log(rl_rand_open01(&rl_rng)) / k);
+      else
+	w *= exp(log(rl_rand_open01(&rl_rng)) / k);
+      skip = floor(log(rl_rand_open01(&rl_rng)) / log1p(-w));
+      if (skip < (double) ((size_t) -1 - seen - 1))
+	next = seen + (size_t) skip + 1;
+      else
+	next = (size_t) -1;
+    }
+  }
+  if (ret < 0)
+    goto out;
+
+  for (i = n; i > 1; i--) {
+    j = rl_rand_range(&rl_rng, i);
+    tmp = sample[j];
+    sample[j] = sample[i - 1];
+    sample[i - 1] = tmp;
+  }
+  for (i = 0; i < n; i++) {
+    if (!rl_output_line(out, sample[i].data, sample[i].len, 0))
+      goto out;
+  }
+  ok = rl_output_flush(out);
+
+  out:
+  for (i = 0; i < n; i++)
+    free(sample[i].data);
+  free(sample);
+  rl_reader_free(&r);
+  return ok;
+}
+
+/* Shuffles an endless stream through a window of n lines. Once the
+   window is full, every new line replaces a randomly chosen line of the
+   window, which is printed. At end of input the window is printed in
+   random order. Output is flushed whenever the reader waits for input, so
+   lines come out as input arrives. */
+static int rl_window_shuffle(struct rl_output *out, struct rl_input *in, size_t n,
+			     char separator)
+{
+  struct rl_reader r;
+  struct rl_window_line {
+    char *data;
+    size_t len;
+    size_t size;
+  } *win, tmp;
+  const char *line;
+  size_t len;
+  size_t used = 0;
+  size_t i, j;
+  int ret;
+  int ok = 0;
+
+  if (!rl_reader_init(&r, in, separator))
+    return 0;
+  r.flush = out;
+  if (!(win = calloc(n, sizeof(win[0])))) {
+    perror("no memory for window");
+    rl_reader_free(&r);
+    return 0;
+  }
+
+  while ((ret = rl_reader_next(&r, &line, &len)) > 0) {
+    if (used < n) {
+      j = used++;
+    } else {
+      j = rl_rand_range(&rl_rng, n);
+      if (!rl_output_line(out, win[j].data, win[j].len, 0))
+	goto out;
+      /* long lines are not copied by the output, and the slot is reused */
+      if (win[j].len >= RL_COPY_LIMIT && !rl_output_flush(out))
+	goto out;
+    }
+    if (len > win[j].size) {
+      char *newdata = realloc(win[j].data, len);
+      if (!newdata) {
+	perror("no memory for window line");
+	goto out;
+      }
+      win[j].data = newdata;
+      win[j].size = len;
+    }
+    memcpy(win[j].data, line, len);
+    win[j].len = len;
+  }
+  if (ret < 0)
+    goto out;
+
+  for (i = used; i > 1; i--) {
+    j = rl_rand_range(&rl_rng, i);
+    tmp = win[j];
+    win[j] = win[i - 1];
+    win[i - 1] = tmp;
+  }
+  for (i = 0; i < used; i++) {
+    if (!rl_output_line(out, win[i].data, win[i].len, 0))
+      goto out;
+  }
+  ok = rl_output_flush(out);
+
+  out:
+  for (i = 0; i < n; i++)
+    free(win[i].data);
+  free(win);
+  rl_reader_free(&r);
+  return ok;
+}
+
+
+/* Phase times and counters for --stats. Reading is the time spent
+   waiting for input, so reads that overlap with indexing do not count. */
+struct rl_stats {
+  double start;
+  double read;
+  double index;
+  double permute;    /* unique, shuffle and sort */
+  unsigned long long inbytes;
+  unsigned long long inlines;
+  size_t indexmem;
+  unsigned long growths;
+};
+
+static void rl_print_phase(const char *name, double t, unsigned long long bytes)
+{
+  if (t > 0 && bytes > 0)
+    fprintf(stderr, "orderlines: %-8s %10.6f s %10.1f MB/s\n", name, t, bytes / t / 1e6);
+  else
+    fprintf(stderr, "orderlines: %-8s %10.6f s\n", name, t);
+}
+
+static void rl_print_stats(const struct rl_stats *st, const struct rl_output *out)
+{
+  struct rusage ru;
+  long maxrss = 0;
+
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    maxrss = ru.ru_maxrss;   /* KiB on Linux */
+
+  rl_print_phase("read", st->read, st->inbytes);
+  rl_print_phase("index", st->index, st->inbytes);
+  rl_print_phase("permute", st->permute, st->inbytes);
+  rl_print_phase("write", out->writetime, out->bytes);
+  rl_print_phase("total", rl_now() - st->start, st->inbytes);
+  if (st->inlines)
+    fprintf(stderr, "orderlines: %llu bytes and %llu lines read\n", st->inbytes, st->inlines);
+  else
+    fprintf(stderr, "orderlines: %llu bytes read\n", st->inbytes);
+  fprintf(stderr, "orderlines: %llu bytes and %llu lines written\n", out->bytes, out->lines);
+  fprintf(stderr, "orderlines: %llu bytes written with %llu write syscalls\n",
+	  out->bytes, out->writes);
+  fprintf(stderr, "orderlines: %llu bytes moved zero-copy with vmsplice\n", out->spliced);
+  fprintf(stderr, "orderlines: index memory %llu bytes, %lu input buffer growths, peak RSS %ld KiB\n",
+	  (unsigned long long) st->indexmem, st->growths, maxrss);
+}
+
+
+/* Library interface */
+
+struct orderlines_view {
+  struct rl_index idx;
+  struct rl_arena arena;
+  char separator;
+  char *sepstr;      /* copy of a multi-byte separator, or NULL */
+  size_t seplen;
+  int forward;       /* sorted views are in index order, others reversed */
+};
+
+void orderlines_options_init(struct orderlines_options *opt)
+{
+  memset(opt, 0, sizeof(*opt));
+  opt->order = ORDERLINES_REVERSE;
+  opt->separator = '\n';
+  opt->fieldsep = -1;
+  opt->threads = 1;
+}
+
+static size_t rl_separator_length(const struct orderlines_options *opt)
+{
+  return opt->separator_string ? opt->separator_length : 1;
+}
+
+static int rl_sort_mode(const struct orderlines_options *opt)
+{
+  if (opt->order == ORDERLINES_NUMERIC_SORT)
+    return RL_SORT_NUMERIC;
+  if (opt->order == ORDERLINES_SORT || (opt->key && opt->order != ORDERLINES_RANDOM))
+    return RL_SORT_LEX;
+  return RL_SORT_NONE;
+}
+
+/* Weighted and stratified orders are random orders printed forwards */
+static int rl_forward(const struct orderlines_options *opt)
+{
+  return rl_sort_mode(opt) != RL_SORT_NONE ||
+    (opt->order == ORDERLINES_RANDOM && (opt->weight_field || opt->stratify_field));
+}
+
+/* Sets up the process wide state for a call: the scanner, the number of
+   threads, huge pages and, for random order, the random generator */
+static int rl_prepare(const struct orderlines_options *opt, int randomize)
+{
+  long n = opt->threads;
+  rl_init_scan();
+  if (n == 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  rl_threads = n > 0 ? n : 1;
+  rl_huge_pages = opt->huge_pages;
+  if (randomize) {
+    if (opt->seeded) {
+      rl_seed_rng(&rl_rng, opt->seed);
+    } else {
+      rl_init_rand();
+      if (opt->need_entropy && !rl_seeded_from_system) {
+	fprintf(stderr, "could not initialize urandom\n");
+	return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Applies unique, random (plain, weighted or stratified) and sorted order
+   to an index */
+static int rl_order_index(struct rl_index *idx, const struct rl_arena *a,
+			  const struct orderlines_options *opt)
+{
+  int sort = rl_sort_mode(opt);
+  if (opt->unique && !rl_unique_index(idx, a))
+    return 0;
+  if (opt->order == ORDERLINES_RANDOM && opt->weight_field) {
+    if (!rl_weight_index(idx, a, opt->weight_field, opt->fieldsep, &rl_rng))
+      return 0;
+  } else if (opt->order == ORDERLINES_RANDOM) {
+    int shuffled = rl_shuffle_parallel(idx);
+    if (shuffled < 0)
+      return 0;
+    if (!shuffled)
+      rl_shuffle_index(idx, &rl_rng);
+    if (opt->stratify_field &&
+	!rl_stratify_index(idx, a, opt->stratify_field, opt->fieldsep, &rl_rng))
+      return 0;
+  }
+  if (sort && !rl_sort_index(idx, a, sort, opt->key, opt->fieldsep))
+    return 0;
+  return 1;
+}
+
+int orderlines_order_buffer(const char *buf, size_t len,
+			    const struct orderlines_options *opt,
+			    struct orderlines_view **view)
+{
+  struct orderlines_view *v;
+  int ret;
+
+  *view = NULL;
+  if (!(v = calloc(1, sizeof(*v)))) {
+    perror("no memory for view");
+    return 0;
+  }
+  v->separator = opt->separator;
+  v->seplen = rl_separator_length(opt);
+  v->forward = rl_forward(opt);
+  if (v->seplen == 0) {
+    fprintf(stderr, "orderlines: empty separator\n");
+    goto error;
+  }
+  if (v->seplen == 1 && opt->separator_string) {
+    v->separator = opt->separator_string[0];
+  } else if (v->seplen > 1) {
+    if (!(v->sepstr = malloc(v->seplen))) {
+      perror("no memory for separator");
+      goto error;
+    }
+    memcpy(v->sepstr, opt->separator_string, v->seplen);
+  }
+  if (!rl_prepare(opt, opt->order == ORDERLINES_RANDOM) ||
+      !rl_arena_wrap(&v->arena, (char *) buf, len, RL_ARENA_BORROWED))
+    goto error;
+  if (v->sepstr)
+    ret = rl_index_scan_multi(&v->idx, buf, len, 0, v->sepstr, v->seplen);
+  else
+    ret = rl_index_scan_parallel(&v->idx, buf, len, v->separator);
+  if (!ret || !rl_index_finish(&v->idx, len) ||
+      !rl_order_index(&v->idx, &v->arena, opt))
+    goto error;
+  *view = v;
+  return 1;
+
+  error:
+  orderlines_view_free(v);
+  return 0;
+}
+
+size_t orderlines_view_lines(const struct orderlines_view *view)
+{
+  return view->idx.n;
+}
+
+const char *orderlines_view_line(const struct orderlines_view *view, size_t i,
+				 size_t *len)
+{
+  if (!view->forward)
+    i = view->idx.n - 1 - i;
+  *len = rl_line_len(&view->idx, i);
+  return rl_arena_ptr(&view->arena, rl_line_offs(&view->idx, i));
+}
+
+int orderlines_view_write(const struct orderlines_view *view, int fd)
+{
+  struct rl_output out;
+  int ret;
+  if (!rl_output_init(&out, fd, view->separator))
+    return 0;
+  if (view->sepstr)
+    rl_output_set_separator(&out, view->sepstr, view->seplen);
+  ret = rl_output_index(&out, &view->idx, &view->arena, view->forward);
+  rl_output_free(&out);
+  return ret;
+}
+
+void orderlines_view_free(struct orderlines_view *view)
+{
+  if (view == NULL)
+    return;
+  rl_index_free(&view->idx);
+  rl_arena_free(&view->arena);
+  free(view->sepstr);
+  free(view);
+}
+
+/* Orders the lines of the given files like the orderlines program */
+int orderlines_run(const struct orderlines_options *opt, char **files,
+		   int nfiles, int outfd)
+{
+  size_t used;
+  char *buf = NULL;
+  size_t ret;
+  struct rl_index idx;
+  struct rl_arena arena;
+  int randomize = opt->order == ORDERLINES_RANDOM || opt->sample || opt->window;
+  char separator = opt->separator;
+  const char *sepstr = opt->separator_string;
+  size_t seplen = rl_separator_length(opt);
+  int nommap = opt->no_mmap;
+  struct rl_input in;
+  int infd;
+  int ownfd = -1;
+  int mapped = 0;
+  size_t max_memory = opt->max_memory;
+  size_t sample = opt->sample;
+  size_t window = opt->window;
+  int external = 0;
+  int pending = 0;
+  struct rl_stats info;
+  double t;
+  int sort = rl_sort_mode(opt);
+  int unique = opt->unique;
+  struct rl_output out;
+
+  memset(&idx, 0, sizeof(idx));
+  memset(&arena, 0, sizeof(arena));
+  memset(&out, 0, sizeof(out));
+  memset(&in, 0, sizeof(in));
+  memset(&info, 0, sizeof(info));
+  info.start = rl_now();
+
+  if (sample && window) {
+    fprintf(stderr, "orderlines: sample and window can not be used together\n");
+    return 0;
+  }
+  if (unique && (sample || window || max_memory)) {
+    fprintf(stderr, "orderlines: unique can not be used with sample, window or max_memory\n");
+    return 0;
+  }
+  if (seplen == 0) {
+    fprintf(stderr, "orderlines: empty separator\n");
+    return 0;
+  }
+  if (seplen > 1 && (sample || window || max_memory)) {
+    fprintf(stderr, "orderlines: multi-byte separators can not be used with sample, window or max_memory\n");
+    return 0;
+  }
+  if (opt->weight_field && opt->stratify_field) {
+    fprintf(stderr, "orderlines: weight and stratify fields can not be used together\n");
+    return 0;
+  }
+  if ((opt->weight_field || opt->stratify_field) && (sample || window || max_memory)) {
+    fprintf(stderr, "orderlines: weight and stratify fields can not be used with sample, window or max_memory\n");
+    return 0;
+  }
+  if (seplen == 1 && sepstr)
+    separator = sepstr[0];
+
+  if (!rl_prepare(opt, randomize))
+    goto error;
+
+  infd = STDIN_FILENO;
+  if (nfiles == 1 && strcmp(files[0], "-") != 0) {
+    if ((infd = open(files[0], O_RDONLY)) < 0) {
+      fprintf(stderr, "orderlines: can not open %s: %s\n", files[0], strerror(errno));
+      goto error;
+    }
+    ownfd = infd;
+  }
+
+  if (!rl_output_init(&out, outfd, separator))
+    goto error;
+  if (seplen > 1)
+    rl_output_set_separator(&out, sepstr, seplen);
+
+  if (nfiles > 1) {
+    /* several files are read as one stream */
+    infd = -1;
+    if (!rl_input_open(&in, files, nfiles))
+      goto error;
+  } else {
+    rl_input_init_fd(&in, infd);
+  }
+
+  if (sample) {
+    if (!rl_sample_lines(&out, &in, sample, separator))
+      goto error;
+    goto done;
+  }
+
+  if (window) {
+    if (!rl_window_shuffle(&out, &in, window, separator))
+      goto error;
+    goto done;
+  }
+
+  if (!randomize && !sort && !unique && seplen == 1 && infd >= 0) {
+    struct stat st;
+    off_t start;
+    if (fstat(infd, &st) == 0 && S_ISREG(st.st_mode) &&
+	(start = lseek(infd, 0, SEEK_CUR)) >= 0) {
+      /* a pipe can take long lines from a mapping without copying */
+      if (!nommap && rl_output_zerocopy(&out) &&
+	  rl_map_input(infd, &buf, &used, max_memory) > 0) {
+	madvise(buf, used, MADV_NORMAL);
+	rl_output_pin(&out, buf, used);
+	info.inbytes = used;
+	ret = rl_output_reverse(&out, buf, used, separator) && rl_output_flush(&out);
+	munmap(buf, used);
+	if (!ret)
+	  goto error;
+	goto done;
+      }
+      info.inbytes = st.st_size - start;
+      if (start < st.st_size &&
+	  !rl_reverse_backward(&out, infd, start, st.st_size, separator))
+	goto error;
+      goto done;
+    }
+  }
+
+  if (infd >= 0 && !nommap) {
+    t = rl_now();
+    mapped = rl_map_input(infd, &buf, &used, max_memory);
+    if (mapped < 0)
+      goto error;
+    info.read += rl_now() - t;
+  }
+
+  if (mapped) {
+    rl_advise_huge(buf, used);
+    if (!rl_arena_wrap(&arena, buf, used, RL_ARENA_MAPPED)) {
+      munmap(buf, used);
+      goto error;
+    }
+    rl_output_pin(&out, buf, used);
+    t = rl_now();
+    if (seplen > 1)
+      ret = rl_index_scan_multi(&idx, buf, used, 0, sepstr, seplen);
+    else
+      ret = rl_index_scan_parallel(&idx, buf, used, separator);
+    if (!ret)
+      goto error;
+    info.index += rl_now() - t;
+  } else {
+    int shift = RL_CHUNK_SHIFT;
+    /* keep chunks small compared to the memory limit */
+    while (max_memory && shift > 12 && (((size_t) 1) << shift) > max_memory / 8)
+      shift--;
+    rl_arena_init(&arena, shift);
+  }
+
+  /* the next read is started before the block that arrived is indexed.
+     only a full chunk waits, as the unfinished line at its end must be
+     indexed before it is moved to the next chunk. */
+  while (!mapped) {
+    struct rl_chunk *c = arena.nchunks ? &arena.chunks[arena.nchunks - 1] : NULL;
+    ssize_t nread;
+    char *data;
+    size_t base;
+    if (!pending) {
+      if (c == NULL || c->len == c->size) {
+	if (max_memory && arena.nchunks > 0 &&
+	    arena.allocated + (((size_t) 1) << arena.shift) + rl_index_size(&idx) > max_memory) {
+	  external = 1;
+	  break;
+	}
+	if (!rl_arena_add_chunk(&arena, &idx))
+	  goto error;
+	c = &arena.chunks[arena.nchunks - 1];
+      }
+      rl_input_start(&in, c->data + c->len, rl_input_piece(c));
+    }
+
+    t = rl_now();
+    nread = rl_input_wait(&in);
+    info.read += rl_now() - t;
+    pending = 0;
+    if (nread < 0)
+      goto error;
+    if (nread == 0)
+      break;
+
+    data = c->data + c->len;
+    base = c->offs + c->len;
+    c->len += nread;
+    arena.end += nread;
+    if (c->len < c->size) {
+      rl_input_start(&in, c->data + c->len, rl_input_piece(c));
+      pending = 1;
+    }
+
+    t = rl_now();
+    if (seplen > 1)
+      ret = rl_index_scan_multi(&idx, data, nread, base, sepstr, seplen);
+    else
+      ret = rl_index_scan(&idx, data, nread, base, separator);
+    if (!ret)
+      goto error;
+    info.index += rl_now() - t;
+  }
+  info.growths = arena.growths;
+
+  if (external) {
+    struct stat st;
+    size_t insize = 0;
+    if (infd >= 0 && fstat(infd, &st) == 0 && S_ISREG(st.st_mode))
+      insize = st.st_size;
+    info.indexmem = rl_index_size(&idx);
+    rl_index_free(&idx);
+    if (randomize)
+      ret = rl_external_randomize(&out, &in, &arena, max_memory, insize, separator, 0);
+    else
+      ret = rl_external_reverse(&out, &in, &arena, max_memory, separator);
+    if (!ret)
+      goto error;
+    goto done;
+  }
+
+  if (!rl_index_finish(&idx, arena.end))
+    goto error;
+  info.inlines = idx.n;
+  info.indexmem = rl_index_size(&idx);
+
+  t = rl_now();
+  if (!rl_order_index(&idx, &arena, opt))
+    goto error;
+  info.permute = rl_now() - t;
+
+  if (!rl_output_index(&out, &idx, &arena, rl_forward(opt)))
+    goto error;
+
+  done:
+  if (opt->stats) {
+    if (info.inbytes == 0)
+      info.inbytes = mapped ? used : in.bytes;
+    rl_print_stats(&info, &out);
+  }
+
+  rl_input_close(&in);
+  rl_arena_free(&arena);
+  rl_index_free(&idx);
+  rl_output_free(&out);
+  if (ownfd >= 0)
+    close(ownfd);
+  return 1;
+
+  error:
+  rl_input_close(&in);
+  rl_arena_free(&arena);
+  rl_index_free(&idx);
+  rl_output_free(&out);
+  if (ownfd >= 0)
+    close(ownfd);
+  return 0;
+}
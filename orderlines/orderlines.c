@@ -9,75 +9,221 @@
       the device is not available)
     - -0 option uses \0 as the separator instead of \n. Perhaps useful with
       find -print0.
+   version 0.2 (development):
+    - an input file may be given as an argument. regular files (also as
+      stdin) are memory mapped and indexed in place instead of being read
+      into a growing buffer
+    - the line index (offsets and lengths) is built with one vectorized
+      (SSE2/AVX2 if available) pass over each block as it is read. lines
+      are no longer rescanned when printing
+    - the line index uses 32-bit offsets and lengths for inputs under 4 GiB
+    - output is gathered into iovec batches and written with writev()
+      instead of two fwrite() calls per line. --stats prints the number of
+      write syscalls to stderr
+    - -r uses an in-process xoshiro256** generator seeded once from
+      getrandom() or /dev/urandom instead of reading /dev/urandom for each
+      line, and unbiased bounded integers. --seed N gives a reproducible
+      order
+    - --max-memory SIZE limits memory use. Larger inputs are spilled to
+      temporary files: reverse order in chunks that are printed back to
+      front, random order into random buckets that are shuffled one by one
+    - reverse order of a regular file reads it backwards in blocks, using
+      constant memory and printing the last lines right away
+    - --threads N builds the index of mapped input and shuffles it in
+      parallel. the shuffle scatters lines into random buckets which are
+      then shuffled by the threads
+    - the index is shuffled completely before output. both the shuffle and
+      the output prefetch the entries and lines they will need a few steps
+      ahead. --huge-pages asks for transparent huge pages for the input
+      buffer and the index
+    - -n K prints K random lines using reservoir sampling (Algorithm L) in
+      one streaming pass with memory for K lines
+    - --window N shuffles a stream through a window of N lines, printing a
+      line for each new input line. works with endless input
+    - input that is read is kept in a chain of 16 MiB chunks instead of a
+      buffer grown with realloc(), so read data is never copied again
+    - --sort and --numeric-sort print the lines in sorted order, with
+      -k N sorting by field N. the index is sorted with an MSD radix sort
+      on cached 8 byte key prefixes, in parallel with --threads
+    - --unique drops repeated lines, keeping the first occurrence. lines
+      are hashed into an open-addressing table of index positions
+    - when stdout is a pipe, long lines of a mapped input file are handed
+      to the kernel with vmsplice() instead of being copied. --stats
+      reports the bytes moved this way
+    - input that is not mapped is read by a reader thread, one block ahead
+      of indexing. several FILE arguments are read as one stream, with
+      read ahead started in all of them. --no-mmap reads regular files
+    - --stats prints read, index, permute and write times with throughput,
+      line and byte counts, index memory, buffer growths and peak RSS
+    - the ordering engine is liborderlines (liborderlines.c, orderlines.h),
+      built as a static and a shared library. it orders a buffer in memory
+      into a view, or runs the whole program. orderlines.c only parses the
+      command line
+    - -s SEP separates lines by any string, such as \r\n. multi-byte
+      separators are found by comparing the first and last byte of SEP
+      at 16 or 32 positions at once and checking the candidates
+    - --weight-field N prints a random order weighted by field N with
+      Efraimidis-Spirakis keys, and --stratify-field N spreads the groups
+      of field N evenly through a random order. both sort the index by
+      random keys computed in one pass, without copying lines
  */
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <stdint.h>
-#include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
 
-static const int RL_RAND_MAX = 0x3FFFFFFF;
+#include "orderlines.h"
 
-static FILE *rl_rf = NULL;
-static long int rl_seed;
-static int rl_must_have_urandom;
-
-static void rl_init_rand(void)
+/* Parses a size with an optional K, M or G suffix */
+static int parse_size(const char *str, size_t *size)
 {
-  rl_seed = time(0);
-  if (rl_seed == -1) {
-    fprintf(stderr, "warning. non-random sequence.\n");
-    rl_seed = 1;
-  }
-  if ((rl_rf = fopen("/dev/urandom", "r"))) {
-    fread(&rl_seed, 1, sizeof(rl_seed), rl_rf);
+  char *end;
+  unsigned long long val;
+  unsigned long long mult = 1;
+  errno = 0;
+  val = strtoull(str, &end, 10);
+  if (errno || end == str)
+    return 0;
+  switch (*end) {
+  case 'k': case 'K': mult = 1ULL << 10; end++; break;
+  case 'm': case 'M': mult = 1ULL << 20; end++; break;
+  case 'g': case 'G': mult = 1ULL << 30; end++; break;
   }
-  srand48(rl_seed);
+  if (*end || val == 0 || val > ((size_t) -1) / mult)
+    return 0;
+  *size = val * mult;
+  return 1;
 }
 
 
-static int rl_rand(void)
+/* Longest -s separator */
+#define MAX_SEPARATOR 256
+
+/* Decodes \n, \r, \t, \0, \\ and \xHH escapes of a separator. Returns the
+   length, or 0 if the separator is empty, too long or invalid. */
+static size_t parse_separator(const char *str, char *sep)
 {
-  int ret;
-  long int rnd;
-  if (rl_rf == 0)
-    return ((double) (RL_RAND_MAX + 1)) * lrand48() / (2147483648.0 + 1.0);
-  ret = fread(&rnd, 1, sizeof(rnd), rl_rf);
-  if (ret == 0) {
-    if (ferror(rl_rf)) {
-      perror("read error in rl_rand");
-      exit(-1);
+  size_t len = 0;
+  unsigned int val;
+  int digits;
+  int c;
+  while (*str) {
+    if (len == MAX_SEPARATOR)
+      return 0;
+    if (*str != '\\') {
+      sep[len++] = *str++;
+      continue;
+    }
+    str++;
+    switch (*str) {
+    case 'n': sep[len++] = '\n'; str++; break;
+    case 'r': sep[len++] = '\r'; str++; break;
+    case 't': sep[len++] = '\t'; str++; break;
+    case '0': sep[len++] = '\0'; str++; break;
+    case '\\': sep[len++] = '\\'; str++; break;
+    case 'x':
+      str++;
+      val = 0;
+      for (digits = 0; digits < 2 && isxdigit((unsigned char) *str); digits++) {
+	c = tolower((unsigned char) *str++);
+	val = val * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+      }
+      if (digits == 0)
+	return 0;
+      sep[len++] = val;
+      break;
+    default:
+      return 0;
     }
-    fprintf(stderr, "strange. end of file with /dev/urandom.\n");
-    exit(-1);
-  }
-  if (ret != sizeof(rnd)) {
-    fprintf(stderr, "strange. fread() should return sizeof(rnd) bytes. returned %d\n", ret);
-    exit(-1);
   }
-  ret = ((double) (RL_RAND_MAX + 1)) * (rnd & 0x7FFFFFFF) / 2147483648.0;
-  return ret;
+  return len;
 }
 
-
 void print_help(void)
 {
   printf("orderlines %s\n\n", RLVERSION);
-  printf("USAGE: orderlines [-0] [-c] [-h] [-r]\n\n");
+  printf("USAGE: orderlines [-0] [-s SEP] [-c] [-h] [-r] [-n K] [--window N] [--seed N]\n");
+  printf("                  [--sort] [--numeric-sort] [-k N] [--field-separator C]\n");
+  printf("                  [--weight-field N] [--stratify-field N] [-u]\n");
+  printf("                  [--max-memory SIZE] [--threads N] [--huge-pages]\n");
+  printf("                  [--no-mmap] [FILE...]\n\n");
   printf("DESCRIPTION:\n");
-  printf("orderlines reads all lines from stdin, and then prints them in a specific\n");
-  printf("order. By default the order is reverse order.\n\n");
+  printf("orderlines reads all lines from FILE (or stdin if FILE is not given or is\n");
+  printf("-), and then prints them in a specific order. By default the order is\n");
+  printf("reverse order. Regular files are read backwards in blocks for reverse\n");
+  printf("order, and memory mapped instead of read for other orders. Several files\n");
+  printf("are read as if they were concatenated, with the kernel reading ahead in\n");
+  printf("all of them at once. Other input is read by a reader thread while the\n");
+  printf("previous block is being indexed. When output is a pipe, long lines of a\n");
+  printf("regular file are spliced into it instead of copied.\n\n");
   printf(" -0 / --null       Make \\0 as the separator instead of \\n. Potentially\n");
   printf("                   useful with \'find -print0\'.\n");
+  printf(" -s SEP / --separator SEP\n");
+  printf("                   Separate lines by string SEP, for example '\\r\\n' or\n");
+  printf("                   '\\n--\\n'. \\n, \\r, \\t, \\0, \\\\ and \\xHH escapes are\n");
+  printf("                   decoded. SEP is written after each line. Multi-byte\n");
+  printf("                   separators work with all orders but not with -n,\n");
+  printf("                   --window and --max-memory.\n");
   printf(" -h / --help       Print help.\n");
   printf(" -c / --check      Force /dev/urandom check for -r.\n");
-  printf(" -r / --randomize  Print out in random order.\n\n");
+  printf(" -r / --randomize  Print out in random order.\n");
+  printf(" -n K / --sample K Print K random lines (or all lines if there are fewer)\n");
+  printf("                   in random order. Reads the input in one pass and\n");
+  printf("                   keeps only K lines in memory.\n");
+  printf(" --window N        Shuffle through a window of N lines. Starts printing\n");
+  printf("                   when N lines have been read, and prints a random line\n");
+  printf("                   of the window for each new line, so it works on\n");
+  printf("                   endless streams. Larger N shuffles better.\n");
+  printf(" --sort            Print in sorted byte order (like LC_ALL=C sort -s).\n");
+  printf("                   Lines with equal keys keep their input order.\n");
+  printf(" --numeric-sort    Sort by the leading decimal number of the key.\n");
+  printf(" -k N / --key N / --field N\n");
+  printf("                   Sort by field N (starting from 1) instead of the\n");
+  printf("                   whole line. Implies --sort if no sort is given.\n");
+  printf("                   Fields are separated by runs of blanks, which are\n");
+  printf("                   not part of the key.\n");
+  printf(" --weight-field N  Print in random order weighted by the number in\n");
+  printf("                   field N: each next line is chosen from the rest\n");
+  printf("                   with probability proportional to its weight. Lines\n");
+  printf("                   without a positive weight come last. Implies -r.\n");
+  printf(" --stratify-field N\n");
+  printf("                   Print in random order with the lines of each value\n");
+  printf("                   of field N spread evenly through the output. Groups\n");
+  printf("                   of the same size are interleaved round-robin.\n");
+  printf("                   Implies -r.\n");
+  printf(" --field-separator C\n");
+  printf("                   Separate fields by character C instead of blanks.\n");
+  printf(" -u / --unique     Print only the first occurrence of each line. Works\n");
+  printf("                   with all orders except -n, --window and\n");
+  printf("                   --max-memory.\n");
+  printf(" --seed N          Seed the random generator with N for a reproducible\n");
+  printf("                   order with -r.\n");
+  printf(" --max-memory SIZE Use at most about SIZE bytes of memory (K, M and G\n");
+  printf("                   suffixes are accepted). Larger inputs are spilled to\n");
+  printf("                   temporary files in $TMPDIR (default /tmp).\n");
+  printf(" --threads N       Build the index, shuffle and sort with N threads. 0\n");
+  printf("                   means one thread per processor.\n");
+  printf(" --no-mmap         Read regular files instead of memory mapping them.\n");
+  printf("                   Reads ahead in large blocks, which can be faster\n");
+  printf("                   than page faults on network filesystems.\n");
+  printf(" --huge-pages      Back the input buffer and the index with transparent\n");
+  printf("                   huge pages to cut TLB misses with -r on large inputs.\n");
+  printf(" --stats           Print to stderr the time and throughput of the read,\n");
+  printf("                   index, permute and write phases, bytes and lines\n");
+  printf("                   read and written, index memory, input buffer\n");
+  printf("                   growths, peak RSS, the number of write syscalls and\n");
+  printf("                   the bytes moved zero-copy. Read time is time spent\n");
+  printf("                   waiting for input. Page faults of mapped input\n");
+  printf("                   count as index time.\n\n");
   
   printf("PROBLEMS:\n");
-  printf("Operating systems which don't have /dev/urandom use time(0) to initialize\n");
-  printf("seed for srand48(). With -c option, error is given if /dev/urandom is not\n");
-  printf("available.\n\n");
+  printf("The random generator (xoshiro256**) is seeded once from getrandom() or\n");
+  printf("/dev/urandom. Operating systems which don't have either use time(0) to\n");
+  printf("initialize the seed. With -c option, error is given if system entropy is\n");
+  printf("not available.\n\n");
   printf("AUTHOR: Heikki Orsila <heikki.orsila@iki.fi>\n");
   printf("COPYING: The program, including the source, is public domain.\n");
 }
@@ -85,29 +231,55 @@ void print_help(void)
 
 int main(int argc, char **argv)
 {
-  size_t maxsize;
-  size_t used;
-  char *buf = NULL;
-  char *newbuf;
-  size_t ret;
   size_t ind;
-  size_t lines;
-  size_t lineind;
-  char **lineptrs = NULL;
-  int beginning;
+  struct orderlines_options opt;
+  char **files = NULL;
+  int nfiles = 0;
   int randomize = 0;
-  char separator = '\n';
+  int sort = 0;
+  char sep[MAX_SEPARATOR];
+  size_t seplen;
+  int ret;
+
+  orderlines_options_init(&opt);
+
+  if (!(files = malloc(sizeof(files[0]) * argc))) {
+    perror("no memory for arguments");
+    return -1;
+  }
 
   ind = 1;
   while (ind < ((size_t) argc)) {
     if (strcmp(argv[ind], "-0") == 0 || strcmp(argv[ind], "--null") == 0) {
-      separator = '\0';
+      opt.separator = '\0';
+      opt.separator_string = NULL;
       ind++;
       continue;
     }
 
+    if (strcmp(argv[ind], "-s") == 0 || strcmp(argv[ind], "--separator") == 0) {
+      if ((ind + 1) >= ((size_t) argc)) {
+	fprintf(stderr, "%s: %s needs a string\n", argv[0], argv[ind]);
+	goto error;
+      }
+      seplen = parse_separator(argv[ind + 1], sep);
+      if (seplen == 0) {
+	fprintf(stderr, "%s: invalid separator %s\n", argv[0], argv[ind + 1]);
+	goto error;
+      }
+      if (seplen == 1) {
+	opt.separator = sep[0];
+	opt.separator_string = NULL;
+      } else {
+	opt.separator_string = sep;
+	opt.separator_length = seplen;
+      }
+      ind += 2;
+      continue;
+    }
+
     if (strcmp(argv[ind], "-c") == 0 || strcmp(argv[ind], "--check") == 0) {
-      rl_must_have_urandom = 1;
+      opt.need_entropy = 1;
       ind++;
       continue;
     }
@@ -119,147 +291,232 @@ int main(int argc, char **argv)
 
     if (strcmp(argv[ind], "-r") == 0 || strcmp(argv[ind], "--randomize") == 0) {
       randomize = 1;
-      rl_init_rand();
       ind++;
       continue;
     }
 
-    fprintf(stderr, "%s: unknown arg %s\n", argv[0], argv[ind]);
-    print_help();
-    goto error;
-  }
-
-  if (randomize && rl_must_have_urandom && rl_rf == NULL) {
-    fprintf(stderr, "could not initialize urandom\n");
-    goto error;
-  }
-
-  maxsize = 4096;
-
-  if (!(buf = malloc(maxsize))) {
-    perror("no memory");
-    goto error;
-  }
-
-  used = 0;
-  lines = 0;
+    if (strcmp(argv[ind], "-n") == 0 || strcmp(argv[ind], "--sample") == 0) {
+      char *end;
+      if ((ind + 1) >= ((size_t) argc)) {
+	fprintf(stderr, "%s: %s needs a number of lines\n", argv[0], argv[ind]);
+	goto error;
+      }
+      errno = 0;
+      opt.sample = strtoull(argv[ind + 1], &end, 10);
+      if (errno || *end || end == argv[ind + 1] || opt.sample == 0) {
+	fprintf(stderr, "%s: invalid number of lines %s\n", argv[0], argv[ind + 1]);
+	goto error;
+      }
+      randomize = 1;
+      ind += 2;
+      continue;
+    }
 
-  while (used < maxsize) {
-    ret = fread(buf + used, 1, maxsize - used, stdin);
-    if (ret == 0)
-      break;
+    if (strcmp(argv[ind], "--window") == 0) {
+      char *end;
+      if ((ind + 1) >= ((size_t) argc)) {
+	fprintf(stderr, "%s: --window needs a number of lines\n", argv[0]);
+	goto error;
+      }
+      errno = 0;
+      opt.window = strtoull(argv[ind + 1], &end, 10);
+      if (errno || *end || end == argv[ind + 1] || opt.window == 0) {
+	fprintf(stderr, "%s: invalid window size %s\n", argv[0], argv[ind + 1]);
+	goto error;
+      }
+      randomize = 1;
+      ind += 2;
+      continue;
+    }
 
-    ind = 0;
-    while (ind < ret) {
-      if (buf[used + ind] == separator)
-	lines++;
+    if (strcmp(argv[ind], "--sort") == 0) {
+      sort = ORDERLINES_SORT;
       ind++;
+      continue;
     }
 
-    used += ret;
+    if (strcmp(argv[ind], "--numeric-sort") == 0) {
+      sort = ORDERLINES_NUMERIC_SORT;
+      ind++;
+      continue;
+    }
 
-    if (used == maxsize) {
-      maxsize *= 2;
-      newbuf = realloc(buf, maxsize);
-      if (!newbuf) {
-	perror("no realloc memory");
+    if (strcmp(argv[ind], "-k") == 0 || strcmp(argv[ind], "--key") == 0 ||
+	strcmp(argv[ind], "--field") == 0) {
+      char *end;
+      if ((ind + 1) >= ((size_t) argc)) {
+	fprintf(stderr, "%s: %s needs a field number\n", argv[0], argv[ind]);
+	goto error;
+      }
+      errno = 0;
+      opt.key = strtoull(argv[ind + 1], &end, 10);
+      if (errno || *end || end == argv[ind + 1] || opt.key == 0) {
+	fprintf(stderr, "%s: invalid field number %s\n", argv[0], argv[ind + 1]);
 	goto error;
       }
-      buf = newbuf;
+      ind += 2;
+      continue;
     }
-  }
 
-  if (used > 0) {
-    if (buf[used - 1] != separator)
-      lines++;
-  }
+    if (strcmp(argv[ind], "--weight-field") == 0 ||
+	strcmp(argv[ind], "--stratify-field") == 0) {
+      char *end;
+      size_t field;
+      if ((ind + 1) >= ((size_t) argc)) {
+	fprintf(stderr, "%s: %s needs a field number\n", argv[0], argv[ind]);
+	goto error;
+      }
+      errno = 0;
+      field = strtoull(argv[ind + 1], &end, 10);
+      if (errno || *end || end == argv[ind + 1] || field == 0) {
+	fprintf(stderr, "%s: invalid field number %s\n", argv[0], argv[ind + 1]);
+	goto error;
+      }
+      if (argv[ind][2] == 'w')
+	opt.weight_field = field;
+      else
+	opt.stratify_field = field;
+      randomize = 1;
+      ind += 2;
+      continue;
+    }
 
-  if (!(lineptrs = malloc(sizeof(char *) * lines))) {
-    perror("no memory for lineptrs");
-    goto error;
-  }
+    if (strcmp(argv[ind], "--field-separator") == 0) {
+      if ((ind + 1) >= ((size_t) argc) || strlen(argv[ind + 1]) != 1) {
+	fprintf(stderr, "%s: --field-separator needs one character\n", argv[0]);
+	goto error;
+      }
+      opt.fieldsep = (unsigned char) argv[ind + 1][0];
+      ind += 2;
+      continue;
+    }
 
-  ind = 0;
-  lineind = 0;
-  beginning = 1;
+    if (strcmp(argv[ind], "--seed") == 0) {
+      char *end;
+      if ((ind + 1) >= ((size_t) argc)) {
+	fprintf(stderr, "%s: --seed needs a value\n", argv[0]);
+	goto error;
+      }
+      errno = 0;
+      opt.seed = strtoull(argv[ind + 1], &end, 0);
+      if (errno || *end || end == argv[ind + 1]) {
+	fprintf(stderr, "%s: invalid seed %s\n", argv[0], argv[ind + 1]);
+	goto error;
+      }
+      opt.seeded = 1;
+      ind += 2;
+      continue;
+    }
 
-  while (ind < used) {
+    if (strcmp(argv[ind], "--max-memory") == 0) {
+      if ((ind + 1) >= ((size_t) argc)) {
+	fprintf(stderr, "%s: --max-memory needs a size\n", argv[0]);
+	goto error;
+      }
+      if (!parse_size(argv[ind + 1], &opt.max_memory) || opt.max_memory < 65536) {
+	fprintf(stderr, "%s: invalid memory size %s (minimum is 64K)\n", argv[0], argv[ind + 1]);
+	goto error;
+      }
+      ind += 2;
+      continue;
+    }
 
-    if (beginning) {
-      if (lineind >= lines) {
-	fprintf(stderr, "fatal error. lineind >= lines. please report.\n");
+    if (strcmp(argv[ind], "--threads") == 0) {
+      char *end;
+      long val;
+      if ((ind + 1) >= ((size_t) argc)) {
+	fprintf(stderr, "%s: --threads needs a number\n", argv[0]);
 	goto error;
       }
-      lineptrs[lineind++] = buf + ind;
-      beginning = 0;
+      val = strtol(argv[ind + 1], &end, 10);
+      if (*end || end == argv[ind + 1] || val < 0 || val > 1024) {
+	fprintf(stderr, "%s: invalid number of threads %s\n", argv[0], argv[ind + 1]);
+	goto error;
+      }
+      opt.threads = val;
+      ind += 2;
+      continue;
     }
 
-    while (ind < used && buf[ind] != separator)
+    if (strcmp(argv[ind], "-u") == 0 || strcmp(argv[ind], "--unique") == 0) {
+      opt.unique = 1;
       ind++;
+      continue;
+    }
 
-    if (buf[ind] == separator) {
-      beginning = 1;
+    if (strcmp(argv[ind], "--huge-pages") == 0) {
+      opt.huge_pages = 1;
       ind++;
+      continue;
     }
-  }
-
-  lineind = lines - 1;
 
-  while (1) {
-    size_t linelen;
-    size_t lineoffs;
-    char *line;
-
-    if (randomize) {
-      size_t randval;
-      char *tmp;
-      randval = (((double) (lineind + 1)) * rl_rand() / (RL_RAND_MAX + 1.0));
-      tmp = lineptrs[randval];
-      lineptrs[randval] = lineptrs[lineind];
-      lineptrs[lineind] = tmp;
+    if (strcmp(argv[ind], "--stats") == 0) {
+      opt.stats = 1;
+      ind++;
+      continue;
     }
 
-    line = lineptrs[lineind];
-    lineoffs = ((intptr_t) line) - ((intptr_t) buf);
-    linelen = 0;
-
-    while ((lineoffs + linelen) < used && line[linelen] != separator)
-      linelen++;
-
-    while (linelen > 0) {
-      ret = fwrite(line, 1, linelen, stdout);
-      if (ret == 0) {
-	if (ferror(stdout)) {
-	  perror("write error");
-	  goto error;
-	}
-	perror("interesting condition fwrite() == 0. report this.");
-	goto error;
-      }
-      line += ret;
-      linelen -= ret;
+    if (strcmp(argv[ind], "--no-mmap") == 0) {
+      opt.no_mmap = 1;
+      ind++;
+      continue;
     }
 
-    while ((ret = fwrite(&separator, 1, 1, stdout)) != 1) {
-      if (ferror(stdout)) {
-	perror("write error");
-	goto error;
-      }
-      fprintf(stderr, "interesting condition while writing separator (%ld)\n", (long) ret);
-      goto error;
+    if (argv[ind][0] != '-' || strcmp(argv[ind], "-") == 0) {
+      files[nfiles++] = argv[ind];
+      ind++;
+      continue;
     }
 
-    if (lineind == 0)
-      break;
-    lineind--;
+    fprintf(stderr, "%s: unknown arg %s\n", argv[0], argv[ind]);
+    print_help();
+    goto error;
+  }
+
+  if (opt.key && !sort)
+    sort = ORDERLINES_SORT;
+
+  if (sort && (randomize || opt.max_memory)) {
+    fprintf(stderr, "%s: sorting can not be used with -r, -n, --window or --max-memory\n", argv[0]);
+    goto error;
   }
 
-  free(buf);
-  free(lineptrs);
-  return 0;
+  if (opt.weight_field && opt.stratify_field) {
+    fprintf(stderr, "%s: --weight-field and --stratify-field can not be used together\n", argv[0]);
+    goto error;
+  }
+
+  if ((opt.weight_field || opt.stratify_field) &&
+      (opt.sample || opt.window || opt.max_memory)) {
+    fprintf(stderr, "%s: --weight-field and --stratify-field can not be used with -n, --window or --max-memory\n", argv[0]);
+    goto error;
+  }
+
+  if (opt.separator_string && (opt.sample || opt.window || opt.max_memory)) {
+    fprintf(stderr, "%s: multi-byte separators can not be used with -n, --window or --max-memory\n", argv[0]);
+    goto error;
+  }
+
+  if (opt.unique && (opt.sample || opt.window || opt.max_memory)) {
+    fprintf(stderr, "%s: --unique can not be used with -n, --window or --max-memory\n", argv[0]);
+    goto error;
+  }
+
+  if (opt.sample && opt.window) {
+    fprintf(stderr, "%s: -n and --window can not be used together\n", argv[0]);
+    goto error;
+  }
+
+  if (sort)
+    opt.order = sort;
+  else if (randomize)
+    opt.order = ORDERLINES_RANDOM;
+
+  ret = orderlines_run(&opt, files, nfiles, fileno(stdout));
+  free(files);
+  return ret ? 0 : -1;
 
   error:
-  free(buf);
-  free(lineptrs);
+  free(files);
   return -1;
 }
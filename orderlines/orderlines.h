@@ -0,0 +1,89 @@
+/* liborderlines: the ordering engine of orderlines as a library. The
+   source code is in public domain. You may do anything with the source
+   code.
+
+   orderlines_order_buffer() orders the lines of a buffer in memory and
+   returns a view of them without copying the buffer. orderlines_run()
+   does everything the orderlines program does, reading files or stdin
+   and writing to a file descriptor.
+
+   The functions print a message to stderr and return 0 on failure, and
+   return 1 on success. They share process wide state (the random
+   generator and the thread count), so they must not be called from
+   several threads at the same time. */
+
+#ifndef _ORDERLINES_H_
+#define _ORDERLINES_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+  ORDERLINES_REVERSE,
+  ORDERLINES_RANDOM,
+  ORDERLINES_SORT,          /* byte order, like sort with LC_ALL=C */
+  ORDERLINES_NUMERIC_SORT   /* leading decimal number */
+};
+
+struct orderlines_options {
+  int order;                /* ORDERLINES_REVERSE by default */
+  char separator;           /* '\n' by default */
+  const char *separator_string; /* multi-byte separator overriding 'separator' */
+  size_t separator_length;
+  int unique;               /* drop repeated lines, not with sample,
+			       window or max_memory */
+  size_t key;               /* sort field starting from 1, 0 is the whole line */
+  int fieldsep;             /* field separator, -1 (default) for blanks */
+  size_t weight_field;      /* random order weighted by this field, 0 is off */
+  size_t stratify_field;    /* random order interleaving the groups of lines
+			       with the same value of this field, 0 is off */
+  int threads;              /* 1 by default, 0 is one per processor */
+  int huge_pages;           /* ask for transparent huge pages */
+  int seeded;               /* use 'seed' instead of system entropy */
+  unsigned long long seed;
+  int need_entropy;         /* fail if system entropy is not available */
+
+  /* used by orderlines_run() only */
+  size_t sample;            /* print this many random lines, 0 is off */
+  size_t window;            /* shuffle through a window of lines, 0 is off */
+  size_t max_memory;        /* spill to temporary files above this, 0 is off */
+  int no_mmap;              /* read regular files instead of mapping them */
+  int stats;                /* print statistics to stderr */
+};
+
+/* An ordered view of the lines of a buffer */
+struct orderlines_view;
+
+void orderlines_options_init(struct orderlines_options *opt);
+
+/* Orders the lines of buf[0 .. len - 1]. The buffer is not copied and
+   must stay valid and unchanged until the view is freed. */
+int orderlines_order_buffer(const char *buf, size_t len,
+			    const struct orderlines_options *opt,
+			    struct orderlines_view **view);
+
+size_t orderlines_view_lines(const struct orderlines_view *view);
+
+/* Returns line i of the ordered view (without the separator) and its
+   length in 'len' */
+const char *orderlines_view_line(const struct orderlines_view *view, size_t i,
+				 size_t *len);
+
+/* Writes the ordered lines to 'fd', each followed by the separator */
+int orderlines_view_write(const struct orderlines_view *view, int fd);
+
+void orderlines_view_free(struct orderlines_view *view);
+
+/* Orders the lines of the given files (stdin if nfiles is 0 or for "-")
+   and writes them to 'outfd'. Several files are read as one stream. */
+int orderlines_run(const struct orderlines_options *opt, char **files,
+		   int nfiles, int outfd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
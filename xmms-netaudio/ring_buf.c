@@ -21,16 +21,30 @@ SOFTWARE.
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "ring_buf.h"
 
+/* The producer publishes 'head' and the consumer 'tail' with these */
+#define RB_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RB_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
 /* buf may be zero, in that case init will allocate the buffer. if ring buffer
    allocates the buffer by itself, it will also free() it in
    ring_buffer_destroy(). However, if the 'buf' was given by the user for the
    init, then ring_buffer_destroy() will not free() it.
+
+   The size must be a power of two. An allocated buffer is rounded up to
+   the next power of two, and only the largest power of two that fits in
+   a given buffer is used.
 */
 int ring_buf_init(struct ring_buf_t *r, void *buf, int size)
 {
+  unsigned int s;
   if (!r) {
     fprintf(stderr, "ring_buf_init: null pointer\n");
     return 0;
@@ -42,7 +56,13 @@ int ring_buf_init(struct ring_buf_t *r, void *buf, int size)
 
   memset(r, 0, sizeof(struct ring_buf_t));
 
-  r->size = size;
+  s = 1;
+  while (s < (unsigned int) size)
+    s <<= 1;
+  if (buf && s > (unsigned int) size)
+    s >>= 1;
+  r->size = s;
+  r->mask = s - 1;
 
   if (buf) {
     /* user gave the buf. this will not be freed in ring_buf_destroy() */
@@ -60,13 +80,77 @@ int ring_buf_init(struct ring_buf_t *r, void *buf, int size)
   return 1;
 }
 
+/* The buffer is a memfd mapped twice into a reserved area of 2 * size
+   bytes. The descriptor is closed after mapping, the mappings keep the
+   pages. */
+int ring_buf_init_mirror(struct ring_buf_t *r, int size)
+{
+#ifdef SYS_memfd_create
+  unsigned int s;
+  long pagesize = sysconf(_SC_PAGESIZE);
+  char *area;
+  int fd;
+  if (!r) {
+    fprintf(stderr, "ring_buf_init_mirror: null pointer\n");
+    return 0;
+  }
+  if (size <= 0 || size >= 0x01000000 || pagesize <= 0) {
+    fprintf(stderr, "ring_buf_init_mirror: illegal size (0x%x)\n", size);
+    return 0;
+  }
+
+  memset(r, 0, sizeof(struct ring_buf_t));
+
+  s = 1;
+  while (s < (unsigned int) size || s < (unsigned int) pagesize)
+    s <<= 1;
+
+  fd = syscall(SYS_memfd_create, "ring_buf", 1 /* MFD_CLOEXEC */);
+  if (fd < 0) {
+    perror("ring_buf_init_mirror: memfd_create");
+    return 0;
+  }
+  if (ftruncate(fd, s)) {
+    perror("ring_buf_init_mirror: ftruncate");
+    close(fd);
+    return 0;
+  }
+  area = mmap(0, 2 * s, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED) {
+    perror("ring_buf_init_mirror: mmap");
+    close(fd);
+    return 0;
+  }
+  if (mmap(area, s, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+      mmap(area + s, s, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    perror("ring_buf_init_mirror: mmap");
+    munmap(area, 2 * s);
+    close(fd);
+    return 0;
+  }
+  close(fd);
+
+  r->buf = area;
+  r->size = s;
+  r->mask = s - 1;
+  r->mirrored = 1;
+  return 1;
+#else
+  r = r;
+  size = size;
+  return 0;
+#endif
+}
+
 void ring_buf_destroy(struct ring_buf_t *r)
 {
   if (!r) {
     fprintf(stderr, "ring_buf_destroy: tried to free null pointer\n");
     return;
   }
-  if (!r->given_buf) {
+  if (r->mirrored) {
+    munmap(r->buf, 2 * r->size);
+  } else if (!r->given_buf) {
     if (r->buf) {
       free(r->buf);
     } else {
@@ -82,42 +166,117 @@ void ring_buf_reset(struct ring_buf_t *r)
     fprintf(stderr, "ring_buf_reset: null pointer\n");
     return;
   }
-  r->input_offs = r->output_offs = 0;
+  r->head = r->tail = 0;
+  r->head_cache = r->tail_cache = 0;
 }
 
 
-/* - x ------------ (x is i and o) */
-/* --- o SSS i ---- */
-/* SSS i --- o SSSS */
+/* head - tail is the content. The whole size is usable, because a full
+   buffer (head - tail == size) and an empty one (head == tail) differ. */
 int ring_buf_free(struct ring_buf_t *r)
 {
-  int i, o, ret;
   if (!r) {
     fprintf(stderr, "ring_buf_free: null pointer\n");
     return 0;
   }
-  i = r->input_offs;
-  o = r->output_offs;
-  ret = (o > i) ? (o - i) : (o + r->size - i);
-  ret--;
-  return ret;
+  r->tail_cache = RB_LOAD_ACQUIRE(&r->tail);
+  return r->size - (r->head - r->tail_cache);
 }
 
 int ring_buf_content(struct ring_buf_t *r)
 {
-  int i, o;
   if (!r) {
     fprintf(stderr, "ring_buf_content: null pointer\n");
     return 0;
   }
-  i = r->input_offs;
-  o = r->output_offs;
-  return (i >= o) ? (i - o) : (i + r->size - o);
+  r->head_cache = RB_LOAD_ACQUIRE(&r->head);
+  return r->head_cache - r->tail;
+}
+
+char *ring_buf_put_reserve(struct ring_buf_t *r, int *len)
+{
+  unsigned int offs = r->head & r->mask;
+  unsigned int span = r->mirrored ? r->size : r->size - offs;
+  unsigned int avail = r->size - (r->head - r->tail_cache);
+  if (avail < span) {
+    /* the cached tail does not cover the span, look at the real one */
+    r->tail_cache = RB_LOAD_ACQUIRE(&r->tail);
+    avail = r->size - (r->head - r->tail_cache);
+  }
+  *len = (avail < span) ? avail : span;
+  return &r->buf[offs];
+}
+
+void ring_buf_put_commit(struct ring_buf_t *r, int len)
+{
+  if (len < 0 || ((unsigned int) len) > r->size - (r->head - r->tail_cache)) {
+    fprintf(stderr, "ring_buf_put_commit: overflow\n");
+    return;
+  }
+  RB_STORE_RELEASE(&r->head, r->head + len);
+}
+
+char *ring_buf_get_reserve(struct ring_buf_t *r, int *len)
+{
+  unsigned int offs = r->tail & r->mask;
+  unsigned int span = r->mirrored ? r->size : r->size - offs;
+  unsigned int content = r->head_cache - r->tail;
+  if (content < span) {
+    r->head_cache = RB_LOAD_ACQUIRE(&r->head);
+    content = r->head_cache - r->tail;
+  }
+  *len = (content < span) ? content : span;
+  return &r->buf[offs];
+}
+
+void ring_buf_get_commit(struct ring_buf_t *r, int len)
+{
+  if (len < 0 || ((unsigned int) len) > r->head_cache - r->tail) {
+    fprintf(stderr, "ring_buf_get_commit: underflow\n");
+    return;
+  }
+  RB_STORE_RELEASE(&r->tail, r->tail + len);
+}
+
+/* Splits 'len' bytes starting at counter 'pos' into at most two regions */
+static int ring_buf_iov(struct ring_buf_t *r, struct iovec *iov,
+			unsigned int pos, int len)
+{
+  unsigned int offs = pos & r->mask;
+  unsigned int first;
+  if (len <= 0)
+    return 0;
+  first = r->size - offs;
+  if (r->mirrored || ((unsigned int) len) <= first)
+    first = len;
+  iov[0].iov_base = &r->buf[offs];
+  iov[0].iov_len = first;
+  if (first == ((unsigned int) len))
+    return 1;
+  iov[1].iov_base = r->buf;
+  iov[1].iov_len = len - first;
+  return 2;
+}
+
+int ring_buf_put_iov(struct ring_buf_t *r, struct iovec *iov, int max)
+{
+  int len = ring_buf_free(r);
+  if (len > max)
+    len = max;
+  return ring_buf_iov(r, iov, r->head, len);
+}
+
+int ring_buf_get_iov(struct ring_buf_t *r, struct iovec *iov, int max)
+{
+  int len = ring_buf_content(r);
+  if (len > max)
+    len = max;
+  return ring_buf_iov(r, iov, r->tail, len);
 }
 
 void ring_buf_put(char *ptr, int len, struct ring_buf_t *r)
 {
-  int i;
+  unsigned int i;
   if (!r) {
     fprintf(stderr, "ring_buf_put: null pointer\n");
     return;
@@ -131,20 +290,20 @@ void ring_buf_put(char *ptr, int len, struct ring_buf_t *r)
     return;
   }
 
-  i = r->input_offs;
-  if ((i + len) <= r->size) {
+  i = r->head & r->mask;
+  if (r->mirrored || (i + len) <= r->size) {
     memcpy(&r->buf[i], ptr, len);
   } else {
     int f = r->size - i;
     memcpy(&r->buf[i], ptr, f);
     memcpy(r->buf, ptr + f, len - f);
   }
-  r->input_offs = (i + len) % r->size;
+  RB_STORE_RELEASE(&r->head, r->head + len);
 }
 
 void ring_buf_get(char *dst, int len, struct ring_buf_t *r)
 {
-  int o;
+  unsigned int o;
   if (!r) {
     fprintf(stderr, "ring_buf_get: null pointer\n");
     return;
@@ -158,44 +317,40 @@ void ring_buf_get(char *dst, int len, struct ring_buf_t *r)
     return;
   }
 
-  o = r->output_offs;
-  if ((o + len) <= r->size) {
+  o = r->tail & r->mask;
+  if (r->mirrored || (o + len) <= r->size) {
     memcpy(dst, &r->buf[o], len);
   } else {
     int f = r->size - o;
     memcpy(dst, &r->buf[o], f);
     memcpy(dst + f, r->buf, len - f);
   }
-  r->output_offs = (o + len) % r->size;
+  RB_STORE_RELEASE(&r->tail, r->tail + len);
 }
 
+/* Calls process() on at most 'max' bytes of content in place. The bytes
+   process() returns are removed from the buffer. */
 int ring_buf_process(int (*process)(char *buf, int size, void *arg),
 		     void *arg, int max, struct ring_buf_t *r)
 {
-  int o;
+  char *ptr;
   int len;
-  int content;
   int processed;
   if (!r) {
-    fprintf(stderr, "ring_buf_get: null pointer\n");
+    fprintf(stderr, "ring_buf_process: null pointer\n");
     return 0;
   }
 
-  content = ring_buf_content(r);
-  if (content == 0) {
+  ptr = ring_buf_get_reserve(r, &len);
+  if (len == 0) {
     return 0;
   }
-  if (content > max) {
-    content = max;
+  if (len > max) {
+    len = max;
   }
-
-  o = r->output_offs;
-  if ((o + content) <= r->size) {
-    len = content;
-  } else {
-    len = r->size - o;
+  processed = process(ptr, len, arg);
+  if (processed > 0) {
+    ring_buf_get_commit(r, processed);
   }
-  processed = process(&r->buf[o], len, arg);
-  r->output_offs = (o + processed) % r->size;
   return processed;
 }
@@ -1,17 +1,59 @@
 #ifndef _XMMS_NETAUDIO_FIFO_H_
 #define _XMMS_NETAUDIO_FIFO_H_
 
+/* A single producer, single consumer ring buffer. One thread may put data
+   while another thread gets it without locking. 'head' is the number of
+   bytes ever put and 'tail' the number of bytes ever got; both run freely
+   and wrap around 2^32, so head - tail is the content even after a wrap.
+   The size is a power of two, so a counter maps to a buffer offset with
+   'mask'.
+
+   The producer owns 'head' and the consumer owns 'tail'. Each is
+   published with a release store after the data is written or read, and
+   the other side loads it with acquire, so the data is always visible
+   before the counter that covers it. The counters live on separate cache
+   lines, each with a cached copy of the other side's counter, so the two
+   threads do not bounce a cache line on every operation.
+
+   Producer functions: ring_buf_free(), ring_buf_put(),
+   ring_buf_put_reserve() and ring_buf_put_commit(). Consumer functions:
+   ring_buf_content(), ring_buf_get(), ring_buf_get_reserve(),
+   ring_buf_get_commit() and ring_buf_process(). ring_buf_reset() may only
+   be called when neither side is running. */
+
+#include <sys/uio.h>
+
+#define RING_BUF_CACHE_LINE 64
+
 struct ring_buf_t {
-  int size;        /* ring buf size */
-  char *buf;       /* ring buffer */
+  char *buf;                /* ring buffer */
+  unsigned int size;        /* ring buf size, a power of two */
+  unsigned int mask;        /* size - 1 */
   int given_buf;   /* if zero, ring_buf_init() allocated the 'buf', otherwise
 		      ring_buf_init() was given the 'buf'. if this is non-zero
 		      ring_buf_destroy() will not free() the 'buf' */
-  int input_offs;  /* position where to put stuff */
-  int output_offs; /* position from where to get stuff */
+  int mirrored;    /* if non-zero, 'buf' is mapped twice back-to-back by
+		      ring_buf_init_mirror() */
+
+  /* producer side */
+  unsigned int head __attribute__ ((aligned (RING_BUF_CACHE_LINE)));
+  unsigned int tail_cache;  /* last seen tail */
+
+  /* consumer side */
+  unsigned int tail __attribute__ ((aligned (RING_BUF_CACHE_LINE)));
+  unsigned int head_cache;  /* last seen head */
 };
 
 int ring_buf_init(struct ring_buf_t *r, void *buf, int size);
+
+/* Initializes a ring buffer whose pages are mapped twice in a row, so
+   buf[i + size] is buf[i]. Every content or free region is then one
+   contiguous span, even across the wrap point, and the reserve functions
+   return all of it. The size is rounded up to a power of two of at least
+   a page. Returns 0 if the system can not do this, in which case
+   ring_buf_init() can be used instead. */
+int ring_buf_init_mirror(struct ring_buf_t *r, int size);
+
 void ring_buf_destroy(struct ring_buf_t *r);
 void ring_buf_reset(struct ring_buf_t *r);
 
@@ -20,6 +62,26 @@ int ring_buf_content(struct ring_buf_t *r);
 void ring_buf_get(char *dst, int len, struct ring_buf_t *r);
 void ring_buf_put(char *ptr, int len, struct ring_buf_t *r);
 
+/* Returns the contiguous free span at the input position and its length
+   in '*len' (0 if the buffer is full). Data written there is put into the
+   buffer by ring_buf_put_commit(). */
+char *ring_buf_put_reserve(struct ring_buf_t *r, int *len);
+void ring_buf_put_commit(struct ring_buf_t *r, int len);
+
+/* Returns the contiguous content span at the output position and its
+   length in '*len' (0 if the buffer is empty). ring_buf_get_commit()
+   removes 'len' bytes of it from the buffer. */
+char *ring_buf_get_reserve(struct ring_buf_t *r, int *len);
+void ring_buf_get_commit(struct ring_buf_t *r, int len);
+
+/* Fill iov[0] and iov[1] with the free (put) or content (get) regions,
+   at most 'max' bytes in total, for readv() or writev(). Return the
+   number of regions: 0, 1, or 2 if the region wraps around the end of a
+   buffer that is not mirrored. The bytes moved are then committed with
+   ring_buf_put_commit() or ring_buf_get_commit(). */
+int ring_buf_put_iov(struct ring_buf_t *r, struct iovec *iov, int max);
+int ring_buf_get_iov(struct ring_buf_t *r, struct iovec *iov, int max);
+
 int ring_buf_process(int (*process)(char *buf, int size, void *arg),
 		     void *arg, int max, struct ring_buf_t *r);
 
@@ -8,6 +8,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
 #include <errno.h>
 
 #include <sys/ioctl.h>
@@ -22,10 +23,16 @@ extern int errno;
 
 static struct event_queue eq;
 
+/* input is not read until the ring buffer has this much space */
 #define MAX_INPUT_SIZE 4096
 
 static const int rbsize = 16384;
 
+/* most bytes moved by one readv() from the socket (-i) and one writev()
+   to the audio device (-o). the default is the whole ring buffer. */
+static int max_read = 16384;
+static int max_write = 16384;
+
 struct stream {
   int valid;
   int fd;
@@ -127,10 +134,12 @@ static void open_dsp(void *meta) {
   dsp_stream.valid = 1;
 }
 
+/* reads stream data directly into the free regions of the ring buffer */
 static int stream_input(struct stream *s) {
   int ret;
   int meta_len = (int) sizeof(struct na_meta);
-  char buf[MAX_INPUT_SIZE];
+  struct iovec iov[2];
+  int niov;
   if (s->meta_size < meta_len) {
     char *metabuf = (char *) (&s->meta);
     ret = read(s->fd, metabuf + s->meta_size, meta_len - s->meta_size);
@@ -155,17 +164,16 @@ static int stream_input(struct stream *s) {
     }
 
   } else {
-    int free = ring_buf_free(&s->rb);
-    if (free > 0) {
-      free = (free <= ((int) sizeof(buf))) ? free : sizeof(buf);
-      ret = read(s->fd, buf, sizeof(buf));
+    niov = ring_buf_put_iov(&s->rb, iov, max_read);
+    if (niov > 0) {
+      ret = readv(s->fd, iov, niov);
       if (ret > 0) {
-	ring_buf_put(buf, ret, &s->rb);
+	ring_buf_put_commit(&s->rb, ret);
 	s->bytes += ret;
       } else if (ret == 0) {
 	fprintf(stderr, "xmms-netaudio: input stream eof\n");
 	s->finished = 1;
-      } else {
+      } else if (errno != EINTR) {
 	perror("xmms-netaudio: input stream input error");
 	return 0;
       }
@@ -177,32 +185,36 @@ static int stream_input(struct stream *s) {
   return 1;
 }
 
-static int dsp_write(char *buf, int size, void *arg) {
-  int fd = (int) arg;
+/* writes the content of the ring buffer directly to the audio device */
+static int dsp_output(struct stream *dsp, struct stream *s) {
+  struct iovec iov[2];
+  int niov;
   int ret;
-  ret = write(fd, buf, size);
-  if (ret < 0) {
-    if (errno != EINTR) {
-      perror("xmms-netaudio: dsp_write");
-      close_stream(&dsp_stream);
-    }
-    return 0;
+  niov = ring_buf_get_iov(&s->rb, iov, max_write);
+  if (niov == 0)
+    return 1;
+  ret = writev(dsp->fd, iov, niov);
+  if (ret > 0) {
+    ring_buf_get_commit(&s->rb, ret);
   } else if (ret == 0) {
-    fprintf(stderr, "xmms-netaudio: interesting: dsp_write returned zero\n");
+    fprintf(stderr, "xmms-netaudio: interesting: dsp_output wrote zero\n");
+  } else if (errno != EINTR) {
+    perror("xmms-netaudio: dsp_output");
+    close_stream(dsp);
     return 0;
   }
-  return ret;
+  return 1;
 }
 
-static int dsp_output(struct stream *dsp, struct stream *s) {
-  int ret;
-  int content;
-  content = ring_buf_content(&s->rb);
-  if (content > 0) {
-    /* process at most 4096 bytes from ring buffer with dsp_write() */
-    ret = ring_buf_process(dsp_write, (void *) dsp->fd, 4096, &s->rb);
+/* parses a batch size option */
+static int batch_size(char *str) {
+  char *end;
+  long val = strtol(str, &end, 10);
+  if (*end || end == str || val <= 0 || val >= 0x01000000) {
+    fprintf(stderr, "xmms-netaudio: illegal batch size %s\n", str);
+    exit(-1);
   }
-  return 1;
+  return val;
 }
 
 int main(int argc, char **argv) {
@@ -226,7 +238,17 @@ int main(int argc, char **argv) {
 	fprintf(stderr, "xmms-netaudio: not enough memory\n");
 	exit(-1);
       }
-      i += 2;
+      i++;
+      continue;
+    }
+    if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "-o")) {
+      if ((i + 1) >= argc)
+	goto perr;
+      if (argv[i][1] == 'i')
+	max_read = batch_size(argv[i + 1]);
+      else
+	max_write = batch_size(argv[i + 1]);
+      i++;
       continue;
     }
   perr:
@@ -240,7 +262,8 @@ int main(int argc, char **argv) {
   }
 
   memset(&in_stream, 0, sizeof(struct stream));
-  if (!ring_buf_init(&in_stream.rb, 0, rbsize)) {
+  if (!ring_buf_init_mirror(&in_stream.rb, rbsize) &&
+      !ring_buf_init(&in_stream.rb, 0, rbsize)) {
     fprintf(stderr, "xmms-netaudio: ring buf init failed\n");
     exit(-1);
   }
@@ -318,14 +341,15 @@ int main(int argc, char **argv) {
       in_stream.bytes = 0;
     }
 
+    /* serve both the input and the output on one wakeup */
     for (i = 1; i < nfds; i++) {
       if (in_stream.valid) {
 	if (pfd[i].fd == in_stream.fd) {
-	  if (pfd[i].events & POLLIN) {
+	  if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
 	    if (!stream_input(&in_stream)) {
 	      close_stream(&in_stream);
 	    }
-	    break;
+	    continue;
 	  }
 	}
       }
@@ -333,7 +357,6 @@ int main(int argc, char **argv) {
 	if (pfd[i].fd == dsp_stream.fd) {
 	  if (pfd[i].revents & POLLOUT) {
 	    (void) dsp_output(&dsp_stream, &in_stream);
-	    break;
 	  }
 	}
       }
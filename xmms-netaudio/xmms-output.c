@@ -30,6 +30,7 @@ SOFTWARE.
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include <sys/time.h>
 #include <pthread.h>
 
 #include <glib.h>
@@ -46,10 +47,22 @@ SOFTWARE.
 
 extern int errno;
 
+/* The sender thread sleeps until the ring buffer holds NA_SEND_THRESHOLD
+   bytes, and then sends all of it at once. A smaller amount is sent
+   after it has waited NA_SEND_TIMEOUT ms, so the end of a song or a
+   paused stream is not held back. */
+#define NA_SEND_THRESHOLD 8192
+#define NA_SEND_TIMEOUT 50
+
 static int na_valid;
-static int na_playing;
+static volatile int na_playing;
 
 static pthread_t na_pth;
+static pthread_mutex_t na_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t na_cond = PTHREAD_COND_INITIALIZER;
+static int na_sender_waiting; /* one of the following, 0 if not waiting */
+#define NA_WAIT_EMPTY 1       /* for any data */
+#define NA_WAIT_THRESHOLD 2   /* for NA_SEND_THRESHOLD bytes or the timeout */
 
 static long long na_input_bytes, na_output_bytes;
 static int na_sockfd;
@@ -67,7 +80,8 @@ static int na_vol_right = 100;
 static void na_init(void) {
   const int na_queue_size = 524288;
   na_valid = 0;
-  if (!ring_buf_init(&rb, 0, na_queue_size)) {
+  if (!ring_buf_init_mirror(&rb, na_queue_size) &&
+      !ring_buf_init(&rb, 0, na_queue_size)) {
     fprintf(stderr, "xmms-netaudio: na_init: no ring buffer\n");
     return;
   }
@@ -112,56 +126,113 @@ static int na_send(int sockfd, void *ptr, int length) {
   pfd.fd = sockfd;
   pfd.events = POLLOUT;
 
+  /* write first and poll only when the socket can not take more */
   buf = (char *) ptr;
   written = 0;
   while (written < length) {
 
-    ret = poll(&pfd, 1, 1000);
-    if (ret < 0) {
-      if (errno != EINTR) {
-	perror("xmms-netaudio: poll returned error");
-	break;
-      }
-    } else if (ret == 0) {
-      continue;
-    }
-
     ret = write(sockfd, &buf[written], length - written);
     if (ret > 0) {
       written += ret;
+      continue;
 
     } else if (ret == 0) {
       fprintf(stderr, "xmms-netaudio: na_send: write returned 0\n");
       break;
 
-    } else {
-      if (errno != EINTR) {
-	perror("xmms-netaudio: na_send");
-	return 0;
-      }
+    } else if (errno == EINTR) {
+      continue;
+
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("xmms-netaudio: na_send");
+      return 0;
+    }
+
+    ret = poll(&pfd, 1, 1000);
+    if (ret < 0 && errno != EINTR) {
+      perror("xmms-netaudio: poll returned error");
+      break;
     }
   }
   return 1;
 }
 
+/* waits until the ring buffer has NA_SEND_THRESHOLD bytes, some bytes
+   have waited for NA_SEND_TIMEOUT ms, or playing stops. an empty buffer
+   is waited for without a timeout, so an idle sender does not wake up.
+   returns the content. */
+static int na_wait_content(void) {
+  struct timeval tv;
+  struct timespec ts;
+  int content;
+  int deadline = 0;
+
+  content = ring_buf_content(&rb);
+  if (content >= NA_SEND_THRESHOLD)
+    return content;
+
+  pthread_mutex_lock(&na_lock);
+  while (na_playing) {
+    content = ring_buf_content(&rb);
+    if (content >= NA_SEND_THRESHOLD)
+      break;
+    if (content == 0) {
+      na_sender_waiting = NA_WAIT_EMPTY;
+      pthread_cond_wait(&na_cond, &na_lock);
+      continue;
+    }
+    if (!deadline) {
+      gettimeofday(&tv, 0);
+      ts.tv_sec = tv.tv_sec;
+      ts.tv_nsec = tv.tv_usec * 1000 + NA_SEND_TIMEOUT * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+	ts.tv_sec++;
+	ts.tv_nsec -= 1000000000;
+      }
+      deadline = 1;
+    }
+    na_sender_waiting = NA_WAIT_THRESHOLD;
+    if (pthread_cond_timedwait(&na_cond, &na_lock, &ts) == ETIMEDOUT) {
+      content = ring_buf_content(&rb);
+      break;
+    }
+  }
+  na_sender_waiting = 0;
+  pthread_mutex_unlock(&na_lock);
+  return content;
+}
+
+/* wakes up the sender if it waits for data and there is enough of it, or
+   unconditionally if 'force' is non-zero. called by the producer after
+   putting data into the ring buffer. */
+static void na_wake_sender(int force) {
+  pthread_mutex_lock(&na_lock);
+  if (force || na_sender_waiting == NA_WAIT_EMPTY ||
+      (na_sender_waiting == NA_WAIT_THRESHOLD &&
+       ((int) rb.size) - ring_buf_free(&rb) >= NA_SEND_THRESHOLD))
+    pthread_cond_signal(&na_cond);
+  pthread_mutex_unlock(&na_lock);
+}
+
+/* runs in its own thread as the only consumer of 'rb'. it sleeps until
+   the producer wakes it up, and then sends everything there is directly
+   from the ring buffer, with one write per contiguous span */
 static void *na_write_loop(void *arg) {
-  const int s = 512;
-  char buf[s];
-  int ret;
+  char *buf;
+  int len;
   arg = arg;
   while (na_playing) {
-    ret = ring_buf_content(&rb);
-    if (ret > s) {
-      ring_buf_get(buf, s, &rb);
+    if (na_wait_content() == 0)
+      continue;
+    while ((buf = ring_buf_get_reserve(&rb, &len)), len > 0) {
       if (na_sockfd >= 0) {
-	if (!na_send(na_sockfd, buf, s)) {
+	if (!na_send(na_sockfd, buf, len)) {
 	  na_close_socket(na_sockfd);
 	  na_sockfd = -1;
 	}
       }
-      na_output_bytes += s;
-    } else {
-      xmms_usleep(10000);
+      ring_buf_get_commit(&rb, len);
+      na_output_bytes += len;
     }
   }
   return 0;
@@ -239,10 +310,12 @@ static void na_write_audio(void *ptr, int length) {
     return;
   }
   ring_buf_put((char *) ptr, length, &rb);
+  na_wake_sender(0);
 }
 
 static void na_close_audio(void) {
   na_playing = 0;
+  na_wake_sender(1);
 
   if (pthread_join(na_pth, 0)) {
     fprintf(stderr, "xmms-netaudio na_close_audio: thread_join failed\n");